@@ -0,0 +1,138 @@
+// Render cost benchmark, built and run by `make bench`.  Instantiates the
+// plugin with a minimal host, plays the bundled clip as a dense grain cloud
+// and times run() at each oversampling factor.
+
+#include "./syncrose.c"
+
+#define BENCH_RATE    48000
+#define BENCH_BLOCK   256
+#define BENCH_WARMUP  200
+#define BENCH_BLOCKS  4000
+#define BENCH_URIS    128
+#define BENCH_NOTIFY  32768
+
+static char*      bench_uris[BENCH_URIS];
+static uint32_t   bench_n_uris;
+static LV2_Handle bench_instance;
+
+static LV2_URID
+bench_map(LV2_URID_Map_Handle handle, const char* uri)
+{
+    for (uint32_t i = 0; i < bench_n_uris; ++i) {
+        if (!strcmp(bench_uris[i], uri)) {
+            return i + 1;
+        }
+    }
+    if (bench_n_uris == BENCH_URIS) {
+        return 0;
+    }
+    bench_uris[bench_n_uris] = strdup(uri);
+    return ++bench_n_uris;
+}
+
+// The worker runs synchronously, only frees reach it while benchmarking
+static LV2_Worker_Status
+bench_respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+    return work_response(bench_instance, size, data);
+}
+
+static LV2_Worker_Status
+bench_schedule(LV2_Worker_Schedule_Handle handle,
+               uint32_t                   size,
+               const void*                data)
+{
+    return work(bench_instance, bench_respond, NULL, size, data);
+}
+
+int
+main(void)
+{
+    // Time decoding, not the cache
+    setenv("SYNCROSE_NO_CACHE", "1", 1);
+
+    LV2_URID_Map              map              = { NULL, bench_map };
+    LV2_Worker_Schedule       schedule         = { NULL, bench_schedule };
+    const LV2_Feature         map_feature      = { LV2_URID__map, &map };
+    const LV2_Feature         schedule_feature = { LV2_WORKER__schedule,
+                                                   &schedule };
+    const LV2_Feature* const  features[]       = { &map_feature,
+                                                   &schedule_feature, NULL };
+
+    bench_instance = instantiate(&descriptor, BENCH_RATE, "./", features);
+    Syncrose* const self = (Syncrose*)bench_instance;
+    if (!self || !self->sample) {
+        fprintf(stderr, "Failed to load ./%s\n", default_sample_file);
+        return 1;
+    }
+
+    // About 32 overlapping grains pitched up, filtered and panned
+    float controls[SYNCROSE_LATENCY + 1] = { 0.0f };
+    controls[SYNCROSE_START]      = 0.1f;
+    controls[SYNCROSE_STEP]       = 0.5f;
+    controls[SYNCROSE_LENGTH]     = 100.0f;
+    controls[SYNCROSE_RATE]       = 320.0f;
+    controls[SYNCROSE_DIVISION]   = 16.0f;
+    controls[SYNCROSE_PITCH]      = 3.0f;
+    controls[SYNCROSE_SPEED]      = 1.0f;
+    controls[SYNCROSE_FILTER]     = 1.0f;
+    controls[SYNCROSE_CUTOFF]     = 8000.0f;
+    controls[SYNCROSE_PAN_SPREAD] = 0.3f;
+    controls[SYNCROSE_CAPTURE]    = 10.0f;
+    for (uint32_t p = SYNCROSE_START; p <= SYNCROSE_LATENCY; ++p) {
+        if (p != SYNCROSE_OUT_R && p != SYNCROSE_IN) {
+            connect_port(bench_instance, p, &controls[p]);
+        }
+    }
+
+    static float out_l[BENCH_BLOCK];
+    static float out_r[BENCH_BLOCK];
+    static float in[BENCH_BLOCK];
+    connect_port(bench_instance, SYNCROSE_OUT_L, out_l);
+    connect_port(bench_instance, SYNCROSE_OUT_R, out_r);
+    connect_port(bench_instance, SYNCROSE_IN, in);
+
+    LV2_Atom_Sequence control;
+    control.atom.type = bench_map(NULL, LV2_ATOM__Sequence);
+    control.atom.size = sizeof(LV2_Atom_Sequence_Body);
+    control.body.unit = 0;
+    control.body.pad  = 0;
+    connect_port(bench_instance, SYNCROSE_CONTROL, &control);
+
+    static uint64_t notify_buf[BENCH_NOTIFY / sizeof(uint64_t)];
+    LV2_Atom_Sequence* const notify = (LV2_Atom_Sequence*)notify_buf;
+    connect_port(bench_instance, SYNCROSE_NOTIFY, notify);
+
+    printf("%u frame blocks at %u Hz, %u blocks per factor\n",
+           BENCH_BLOCK, BENCH_RATE, BENCH_BLOCKS);
+    for (uint32_t os = 1; os <= 4; os *= 2) {
+        controls[SYNCROSE_OVERSAMPLE] = (float)os;
+
+        // A note on starts the grains, the warm-up fills the pool
+        self->play = true;
+        struct timespec t0;
+        struct timespec t1;
+        for (uint32_t b = 0; b < BENCH_WARMUP + BENCH_BLOCKS; ++b) {
+            if (b == BENCH_WARMUP) {
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+            }
+            notify->atom.size = sizeof(notify_buf) - sizeof(LV2_Atom);
+            run(bench_instance, BENCH_BLOCK);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        const double us = ((t1.tv_sec - t0.tv_sec) * 1e6
+                           + (t1.tv_nsec - t0.tv_nsec) / 1e3) / BENCH_BLOCKS;
+        const double budget = 1e6 * BENCH_BLOCK / BENCH_RATE;
+        printf("%ux  %2u grains  %7.1f us/block  %5.2f%% of real time"
+               "  latency %u\n",
+               os, self->pool.count, us, 100.0 * us / budget,
+               (unsigned)controls[SYNCROSE_LATENCY]);
+    }
+
+    cleanup(bench_instance);
+    for (uint32_t i = 0; i < bench_n_uris; ++i) {
+        free(bench_uris[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * fft.h
+ *
+ * Copyright (c) 2017 Kyle Kneitiner <kyle@kneit.in>
+ *
+ * This software is licensed under the 3-Clause BSD License
+ * For license details see syncrose/LICENSE
+ * or https://opensource.org/licenses/BSD-3-Clause
+ *
+ */
+
+#ifndef SYNCROSE_FFT_H
+#define SYNCROSE_FFT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifndef __cplusplus
+#    include <stdbool.h>
+#endif
+
+// Radix-2 complex FFT with tables computed up front, so fft_run() never
+// allocates and is safe to call from run()
+typedef struct {
+    uint32_t  size;    // Transform size, a power of two
+    uint32_t* bitrev;  // Bit reversed index for each input
+    float*    cosine;  // cos(2 pi k / size) for k < size / 2
+    float*    sine;    // sin(2 pi k / size) for k < size / 2
+} FFTPlan;
+
+static void
+fft_plan_free(FFTPlan* plan)
+{
+    free(plan->bitrev);
+    free(plan->cosine);
+    free(plan->sine);
+    plan->bitrev = NULL;
+    plan->cosine = NULL;
+    plan->sine   = NULL;
+}
+
+static bool
+fft_plan_init(FFTPlan* plan, uint32_t size)
+{
+    uint32_t bits = 0;
+    while ((1u << bits) < size) {
+        ++bits;
+    }
+
+    plan->size   = size;
+    plan->bitrev = (uint32_t*)malloc(sizeof(uint32_t) * size);
+    plan->cosine = (float*)malloc(sizeof(float) * size / 2);
+    plan->sine   = (float*)malloc(sizeof(float) * size / 2);
+    if (!plan->bitrev || !plan->cosine || !plan->sine) {
+        fft_plan_free(plan);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        uint32_t r = 0;
+        for (uint32_t b = 0; b < bits; ++b) {
+            r |= ((i >> b) & 1u) << (bits - 1 - b);
+        }
+        plan->bitrev[i] = r;
+    }
+
+    for (uint32_t k = 0; k < size / 2; ++k) {
+        plan->cosine[k] = (float)cos(2.0 * M_PI * k / size);
+        plan->sine[k]   = (float)sin(2.0 * M_PI * k / size);
+    }
+
+    return true;
+}
+
+// In-place transform of re/im, the inverse is not scaled by 1 / size
+static void
+fft_run(const FFTPlan* plan, float* re, float* im, bool inverse)
+{
+    const uint32_t size = plan->size;
+    const float    sign = inverse ? 1.0f : -1.0f;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        const uint32_t j = plan->bitrev[i];
+        if (j > i) {
+            const float tr = re[i];
+            const float ti = im[i];
+            re[i] = re[j];
+            im[i] = im[j];
+            re[j] = tr;
+            im[j] = ti;
+        }
+    }
+
+    for (uint32_t len = 2; len <= size; len <<= 1) {
+        const uint32_t half   = len >> 1;
+        const uint32_t stride = size / len;
+        for (uint32_t start = 0; start < size; start += len) {
+            for (uint32_t k = 0; k < half; ++k) {
+                const float    wr = plan->cosine[k * stride];
+                const float    wi = sign * plan->sine[k * stride];
+                const uint32_t a  = start + k;
+                const uint32_t b  = a + half;
+                const float    xr = re[b] * wr - im[b] * wi;
+                const float    xi = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - xr;
+                im[b] = im[a] - xi;
+                re[a] += xr;
+                im[a] += xi;
+            }
+        }
+    }
+}
+
+#endif
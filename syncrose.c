@@ -1,10 +1,21 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #ifndef __cplusplus
 #    include <stdbool.h>
 #endif
 
+#include <samplerate.h>
 #include <sndfile.h>
 
 #include "lv2/lv2plug.in/ns/ext/atom/forge.h"
@@ -18,25 +29,263 @@
 #include "lv2/lv2plug.in/ns/ext/worker/worker.h"
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 
+#include "./fft.h"
 #include "./uris.h"
 
 enum {
     SYNCROSE_CONTROL = 0,
     SYNCROSE_NOTIFY  = 1,
-    SYNCROSE_OUT     = 2,
-    SYNCROSE_START   = 3,
-    SYNCROSE_STEP   = 4
+    SYNCROSE_OUT_L   = 2,
+    SYNCROSE_START    = 3,
+    SYNCROSE_STEP     = 4,
+    SYNCROSE_LENGTH   = 5,
+    SYNCROSE_RATE     = 6,
+    SYNCROSE_SYNC     = 7,
+    SYNCROSE_DIVISION = 8,
+    SYNCROSE_MODE     = 9,
+    SYNCROSE_PITCH    = 10,
+    SYNCROSE_SPEED    = 11,
+    SYNCROSE_FILTER   = 12,
+    SYNCROSE_CUTOFF   = 13,
+    SYNCROSE_SPREAD   = 14,
+    SYNCROSE_RESONANCE = 15,
+    SYNCROSE_OUT_R     = 16,
+    SYNCROSE_PAN       = 17,
+    SYNCROSE_PAN_SPREAD = 18,
+    SYNCROSE_IN         = 19,
+    SYNCROSE_SOURCE     = 20,
+    SYNCROSE_CAPTURE    = 21,
+    SYNCROSE_FREEZE     = 22,
+    SYNCROSE_OVERSAMPLE = 23,
+    SYNCROSE_LATENCY    = 24
 };
 
+typedef enum {
+    SOURCE_SAMPLE = 0,
+    SOURCE_LIVE   = 1
+} SyncroseSource;
+
+typedef enum {
+    MODE_TIME     = 0,
+    MODE_SPECTRAL = 1
+} SyncroseMode;
+
+typedef enum {
+    FILTER_OFF      = 0,
+    FILTER_LOWPASS  = 1,
+    FILTER_BANDPASS = 2,
+    FILTER_HIGHPASS = 3
+} SyncroseFilter;
+
 static const char* default_sample_file = "clip.wav";
 
+// Frames decoded between checks for a newer load request
+#define DECODE_CHUNK 65536
+
+// Files at least this long are decoded in parallel chunks
+#define PARALLEL_MIN_FRAMES (1 << 22)
+#define PARALLEL_CHUNK      (1 << 20)
+#define PARALLEL_MAX_THREADS 16
+
+// Zones per sample map, loaded by up to PARALLEL_MAX_THREADS threads
+#define MAX_ZONES 128
+
+// Size of the buffer holding the newest sample load request
+#define LOAD_MSG_SIZE (sizeof(LoadMessage) + PATH_MAX + 256)
+
+// STFT analysis of samples for the spectral engine, 75% overlap
+#define SPECTRAL_SIZE       2048
+#define SPECTRAL_HOP        (SPECTRAL_SIZE / 4)
+#define SPECTRAL_BINS       (SPECTRAL_SIZE / 2 + 1)
+#define SPECTRAL_MAX_FRAMES (1 << 22)
+
+// Analysed magnitudes are stored as log2(magnitude) in 1/1024 octave steps
+// around SPECTRAL_MAG_ZERO, with 0 for silence
+#define SPECTRAL_MAG_STEPS 1024.0f
+#define SPECTRAL_MAG_ZERO  32768.0f
+
+// Size of the grain pool, onsets per segment, and grain window table
+#define MAX_GRAINS  64
+#define GRAIN_LANES 8
+#define MAX_ONSETS  256
+#define WINDOW_SIZE 1024
+
+// Longest live capture window, the ring also holds room for grains pitched
+// up to read ahead of their start without reaching the write head
+#define MAX_CAPTURE_SECONDS    30
+#define CAPTURE_MARGIN_SECONDS 4
+
+// Grains are mixed in chunks of this many host frames when oversampling
+#define OVERSAMPLE_CHUNK 64
+
+// Half-band decimators have 4 * taps - 1 coefficients, all zero but the
+// centre and 2 * taps odd ones.  The 4x to 2x stage only has to keep its
+// wide transition band out of the final passband, so it is much shorter.
+// Its taps must be odd for the cascade to have a whole frame of latency.
+#define HALFBAND_TAPS       14
+#define HALFBAND_FIRST_TAPS 5
+#define HALFBAND_BETA       7.0
+
+// The spectral engine runs at the host rate and is delayed by the decimator
+// latency to stay aligned with the grains, this is a power of two above it
+#define SPECTRAL_DELAY 16
+
+// Constant power pan law, entries from hard left to hard right
+#define PAN_SIZE 256
+
+// Telemetry frames sent to the UI per second, the most grains per frame is
+// TELEMETRY_MAX_GRAINS in uris.h
+#define TELEMETRY_RATE 30
+
+// Decoded sample cache, see load_cached_sample()
+#define CACHE_MAGIC   "SYNCROSE"
+#define CACHE_VERSION 2
+#define CACHE_ALIGN   4096
+
+typedef struct {
+    char     magic[8];           // CACHE_MAGIC
+    uint32_t version;            // CACHE_VERSION
+    uint32_t channels;           // Number of planes following the header
+    uint64_t frames;             // Frames per plane
+    uint64_t source_size;        // Size of the source file in bytes
+    int64_t  source_mtime_sec;   // Modification time of the source file
+    int64_t  source_mtime_nsec;
+    double   rate;               // Rate the data was resampled to
+    uint32_t path_len;           // Length of source path following header
+    uint32_t data_offset;        // Offset of first plane, CACHE_ALIGN aligned
+    uint32_t has_overview;       // Nonzero if overview is set, not for zones
+    float    overview[2 * OVERVIEW_COLUMNS];  // See Sample
+} CacheHeader;
+
+// Compact STFT bin, half the size of a float magnitude and phase
+typedef struct {
+    uint16_t mag;    // Log magnitude, see SPECTRAL_MAG_STEPS
+    int16_t  phase;  // Phase in units of pi / 32768
+} SpectralBin;
+
 typedef struct {
     SF_INFO  info;      // Info about sample from sndfile
     float*   data;      // Sample data in float
     char*    path;      // Path of file
     uint32_t path_len;  // Length of path
+    void*    map;       // Cache file mapping backing data, or NULL
+    size_t   map_len;   // Length of map
+
+    // Source file status of a serial decode not cached yet, see work()
+    struct stat source_st;
+    bool        uncached;
+
+    // STFT of the sample, SPECTRAL_BINS bins per analysis frame.  Only
+    // computed by the worker once spectral mode is used with the sample,
+    // analysed is set when spectrum may be read and stays false if the
+    // sample is too long or analysis failed.
+    SpectralBin* spectrum;
+    uint32_t     spectrum_frames;
+    atomic_bool  analysed;
+    bool         analysis_requested;  // Only accessed from run() and restore()
+
+    // Worker jobs queued or running on the sample.  Frees sent to the worker
+    // run after them, restore() waits for them if it frees the sample itself.
+    atomic_uint worker_refs;
+
+    // Frames decoded from the head, less than info.frames while a
+    // parallel decode is still filling in the tail
+    _Atomic sf_count_t ready;
+
+    struct DecodeJob* job;  // Parallel decode in progress, or NULL
+
+    // Waveform overview for the UI as (min, max) pairs, computed as the
+    // sample is decoded and set once it is complete.  Zones of a map have
+    // none, the UI shows no waveform for a map.
+    float       overview[2 * OVERVIEW_COLUMNS];
+    atomic_bool overview_ready;
 } Sample;
 
+// Key and velocity zone of a sample map, ranges are inclusive
+typedef struct {
+    uint8_t lo_key;
+    uint8_t hi_key;
+    uint8_t lo_vel;
+    uint8_t hi_vel;
+    uint8_t root;    // Key the sample plays at its own pitch
+    char*   path;    // Absolute path of the zone sample
+    Sample* sample;
+} Zone;
+
+// Samples mapped across keys and velocities, with the zone of every key
+// and velocity flattened into a table so a note-on picks its sample with
+// a single lookup
+typedef struct {
+    char*    path;      // Path of the map file
+    uint32_t path_len;  // Length of path
+    uint32_t n_zones;
+    Zone     zones[MAX_ZONES];
+    uint8_t  table[128][128];  // Zone index + 1 by key and velocity, or 0
+} SampleMap;
+
+// Worker request to load the sample in the patch:Set object following it
+typedef struct {
+    LV2_Atom atom;        // Type is syncrose:loadSample
+    uint32_t gen;         // Generation of this request
+    uint32_t superseded;  // Requests dropped in favour of this one
+} LoadMessage;
+
+// Worker reply to a LoadMessage, at most one of sample and map is set and
+// both are NULL if loading failed or was abandoned
+typedef struct {
+    Sample*    sample;
+    SampleMap* map;
+    uint32_t   gen;
+} LoadResponse;
+
+// Grains stored struct-of-arrays, so render() can filter and mix them with
+// one grain per SIMD lane.  Active grains are packed at the front, and the
+// lanes after them up to a multiple of GRAIN_LANES are kept silent.
+typedef struct {
+    double pos[MAX_GRAINS];     // Read position in sample frames
+    double last[MAX_GRAINS];    // Last readable frame of the grain source
+    float  inc[MAX_GRAINS];     // Read increment per frame
+    float  amp[MAX_GRAINS];     // Peak amplitude
+    float  phase[MAX_GRAINS];   // Window phase, 0..WINDOW_SIZE
+    float  dphase[MAX_GRAINS];  // Window phase increment per frame
+    float  x[MAX_GRAINS];       // Windowed input for the current frame
+    float  gain_l[MAX_GRAINS];  // Pan gains
+    float  gain_r[MAX_GRAINS];
+
+    // Sample each grain reads, so grains outlive a note-on changing zone.
+    // NULL for live grains, which read the capture ring.
+    const Sample* src[MAX_GRAINS];
+
+    // Trapezoidal state variable filter per grain, output is
+    // m0 * input + m1 * bandpass + m2 * lowpass
+    float a1[MAX_GRAINS];
+    float a2[MAX_GRAINS];
+    float a3[MAX_GRAINS];
+    float m0[MAX_GRAINS];
+    float m1[MAX_GRAINS];
+    float m2[MAX_GRAINS];
+    float ic1[MAX_GRAINS];
+    float ic2[MAX_GRAINS];
+
+    uint32_t count;
+} GrainPool;
+
+typedef struct {
+    uint32_t frame;  // Offset into the segment being rendered
+    double   pos;    // Read position in sample frames
+} Onset;
+
+// Polyphase half-band decimator by 2.  Input is split into even and odd
+// frames: the even branch only passes through the centre tap, and the odd
+// branch is filtered a tap at a time across a chunk of outputs, which the
+// compiler vectorises.  Each branch is kept with its history in front.
+typedef struct {
+    uint32_t taps;                                   // Distinct odd taps
+    float    coef[2 * HALFBAND_TAPS];                // Odd branch FIR
+    float    even[HALFBAND_TAPS + 2 * OVERSAMPLE_CHUNK];
+    float    odd[2 * HALFBAND_TAPS + 2 * OVERSAMPLE_CHUNK];
+} HalfBand;
+
 typedef struct {
     // Features
     LV2_URID_Map*        map;
@@ -47,14 +296,44 @@ typedef struct {
     // Logger convenience API
     LV2_Log_Logger logger;
 
-    Sample* sample;
-    bool    sample_changed;
+    Sample*    sample;          // Sample new grains read
+    SampleMap* sample_map;      // Map owning sample, or NULL if standalone
+    float      key_pitch;       // Playback ratio of the note against its root
+    bool       sample_changed;
+    bool       overview_sent;   // The UI has the overview of sample
+
+    // Sample loading, at most one request is in the worker at a time
+    atomic_uint load_gen;         // Generation of the newest request
+    bool        loading;          // A request is in the worker
+    bool        load_pending;     // pending_load holds a request to send
+    uint32_t    load_superseded;  // Requests replaced by pending_load
+    uint8_t     pending_load[LOAD_MSG_SIZE];
 
     const LV2_Atom_Sequence* control_port;
     LV2_Atom_Sequence*       notify_port;
-    float*                   output_port;
+    float*                   output_l_port;
+    float*                   output_r_port;
+    const float*             input_port;
     float*                   start_port;
-    float*                     step_port;
+    float*                   step_port;
+    float*                   length_port;
+    float*                   rate_port;
+    float*                   sync_port;
+    float*                   division_port;
+    float*                   mode_port;
+    float*                   pitch_port;
+    float*                   speed_port;
+    float*                   filter_port;
+    float*                   cutoff_port;
+    float*                   spread_port;
+    float*                   resonance_port;
+    float*                   pan_port;
+    float*                   pan_spread_port;
+    float*                   source_port;
+    float*                   capture_port;
+    float*                   freeze_port;
+    float*                   oversample_port;
+    float*                   latency_port;
 
     // Forge frame for notify port (for writing worker replies)
     LV2_Atom_Forge_Frame notify_frame;
@@ -62,15 +341,98 @@ typedef struct {
     // URIs
     SyncroseURIs uris;
 
+    // Host sample rate, all samples are resampled to this
+    double rate;
+
+    // Directory for decoded sample cache, or NULL if disabled
+    char* cache_dir;
+
     // Position in run() if sample is already in progress
     uint32_t frame_offset;
 
+    // Telemetry snapshot for the UI as (position, amplitude) pairs
+    float    telemetry[2 * TELEMETRY_MAX_GRAINS];
+    uint32_t telemetry_period;     // Frames between telemetry frames
+    uint32_t telemetry_countdown;  // Frames until the next telemetry frame
+    bool     telemetry_active;     // Last frame had grains
+
+    // Grain pool and envelope
+    GrainPool pool;
+    float     window[WINDOW_SIZE + 1];
+    float     pan_table[2 * (PAN_SIZE + 1)];  // (left, right) gain pairs
+    uint32_t  rng;
+
+    // Grain onsets for the segment being rendered
+    Onset onsets[MAX_ONSETS];
+
+    // Spectral engine, a phase vocoder resynthesising the sample STFT
+    FFTPlan  fft;
+    float    spec_window[SPECTRAL_SIZE];  // Synthesis window
+    float    spec_re[SPECTRAL_SIZE];      // Inverse FFT buffers
+    float    spec_im[SPECTRAL_SIZE];
+    float    spec_phase[SPECTRAL_BINS];   // Synthesis phase per bin
+    float    spec_mag[SPECTRAL_BINS];     // Analysis magnitudes for this hop
+    float    spec_phase0[SPECTRAL_BINS];  // Analysis phases for this hop
+    uint32_t spec_peak[SPECTRAL_BINS];    // Nearest magnitude peak of each bin
+    float    spec_ola[SPECTRAL_SIZE];     // Overlap-add accumulator
+    float    spec_out[SPECTRAL_HOP];      // Finished hop being output
+    uint32_t spec_out_pos;                // Next frame to output from spec_out
+    double   spec_pos;                    // Analysis frame being read
+    float    spec_delay[SPECTRAL_DELAY];  // Output delayed by the latency
+    uint32_t spec_delay_pos;              // Next write into spec_delay
+
+    // Oversampled grain mix and its decimators by stage, 4x to 2x then 2x
+    // to 1x, for each channel
+    uint32_t oversample;                     // Mix rate over host rate
+    uint32_t latency;                        // Decimator latency in frames
+    float    os_l[4 * OVERSAMPLE_CHUNK];
+    float    os_r[4 * OVERSAMPLE_CHUNK];
+    float    os_mid[2 * OVERSAMPLE_CHUNK];   // Output of the 4x to 2x stage
+    HalfBand decim[2][2];
+
+    // Live input capture ring, a power of two so reads can wrap by mask
+    float*   ring;
+    uint64_t ring_mask;
+    uint64_t write_pos;  // Frames written to the ring
+    uint64_t live_now;   // Write position at the frame being rendered
+
+    // Grain parameters, updated from ports and transport
+    double loop_start;       // First frame of the loop region
+    double loop_len;         // Length of the loop region in frames
+    double loop_beats;       // Length of the loop region in beats if synced
+    double interval;         // Free-running onset interval in frames
+    double interval_beats;   // Synced onset interval in beats
+    double frames_per_beat;  // Sample frames read per beat if synced
+    double grain_len;        // Grain length in frames
+    float  pitch;            // Playback ratio for pitch shifting
+    bool   spectral;         // Spectral engine is playing instead of grains
+    bool   live;             // Grains read from the capture ring
+    bool   freeze;           // Capture is stopped
+    double capture_len;      // Live capture window in frames
+    float  grain_amp;        // Grain amplitude normalised for overlap
+    int    filter;           // SyncroseFilter for new grains
+    float  cutoff;           // Filter cutoff in Hz
+    float  cutoff_spread;    // Random cutoff spread in octaves
+    float  filter_k;         // Filter damping, 2 - 2 * resonance
+    float  pan;              // Pan centre, 0 left to 1 right
+    float  pan_spread;       // Random pan spread around the centre
+    bool   synced;           // Following the host transport
+
+    // Host transport
+    double bpm;
+    double speed;
+    double beat;             // Beats since the start of bar 0
+    double beats_per_bar;
+    double beat_unit;
+    bool   has_position;
+    double next_beat;        // Beat of the next synced onset
+    bool   next_beat_valid;  // False after a relocation or grid change
+
     // Playback state
-    float      gain;
-    sf_count_t frame;
-    sf_count_t step;
-    sf_count_t start;
-    bool       play;
+    float  gain;
+    double head;             // Free-running read offset into the loop region
+    double next_onset;       // Frames until the next free-running onset
+    bool   play;
 } Syncrose;
 
 typedef struct {
@@ -78,39 +440,716 @@ typedef struct {
     Sample*  sample;
 } SampleMessage;
 
-static Sample*
-load_sample(Syncrose* self, const char* path)
+typedef struct {
+    LV2_Atom   atom;
+    SampleMap* map;
+} SampleMapMessage;
+
+// Build the cache file path for a source path at the current rate
+static bool
+get_cache_path(Syncrose* self, const char* path, char* buf, size_t size)
 {
+    if (!self->cache_dir) {
+        return false;
+    }
+
+    // 64-bit FNV-1a over the source path and target rate
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char* c = path; *c; ++c) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ull;
+    }
+    const uint64_t rate = (uint64_t)self->rate;
+    for (unsigned i = 0; i < sizeof(rate); ++i) {
+        hash = (hash ^ ((rate >> (i * 8)) & 0xFF)) * 0x100000001b3ull;
+    }
+
+    const int len = snprintf(buf, size, "%s/%016llx.f32",
+                             self->cache_dir, (unsigned long long)hash);
+    return len > 0 && (size_t)len < size;
+}
+
+// Find (and create) the cache directory, $XDG_CACHE_HOME/syncrose
+static char*
+get_cache_dir(void)
+{
+    if (getenv("SYNCROSE_NO_CACHE")) {
+        return NULL;
+    }
+
+    char        base[PATH_MAX];
+    const char* xdg  = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (xdg && *xdg) {
+        snprintf(base, sizeof(base), "%s", xdg);
+    } else if (home && *home) {
+        snprintf(base, sizeof(base), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s/syncrose", base) >= (int)sizeof(dir)) {
+        return NULL;
+    }
+
+    if ((mkdir(base, 0755) && errno != EEXIST) ||
+        (mkdir(dir, 0755) && errno != EEXIST)) {
+        return NULL;
+    }
+
+    return strdup(dir);
+}
+
+// Map a previously decoded sample from the cache, if it is still valid
+static bool
+load_cached_sample(Syncrose*          self,
+                   const char*        path,
+                   const struct stat* st,
+                   Sample*            sample)
+{
+    char cache_path[PATH_MAX];
+    if (!get_cache_path(self, path, cache_path, sizeof(cache_path))) {
+        return false;
+    }
+
+    const int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat cst;
+    if (fstat(fd, &cst) || (size_t)cst.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    const size_t map_len = (size_t)cst.st_size;
+    void* const  map     = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    // Revalidate against the source file and our rate.  Offsets are checked
+    // against the mapping before anything past the header is read.
+    const CacheHeader* const h        = (const CacheHeader*)map;
+    const size_t             path_len = strlen(path);
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) ||
+        h->version != CACHE_VERSION ||
+        h->channels != 1 ||
+        h->source_size != (uint64_t)st->st_size ||
+        h->source_mtime_sec != (int64_t)st->st_mtim.tv_sec ||
+        h->source_mtime_nsec != (int64_t)st->st_mtim.tv_nsec ||
+        h->rate != self->rate ||
+        h->path_len != path_len ||
+        sizeof(CacheHeader) + path_len > h->data_offset ||
+        h->data_offset > map_len ||
+        memcmp(h + 1, path, path_len) ||
+        h->frames > ((map_len - h->data_offset)
+                     / (h->channels * sizeof(float))) ||
+        h->data_offset + h->frames * h->channels * sizeof(float) != map_len) {
+        munmap(map, map_len);
+        return false;
+    }
+
+    lv2_log_trace(&self->logger, "Using cached sample %s\n", cache_path);
+
+    madvise(map, map_len, MADV_WILLNEED);
+
+    memset(&sample->info, 0, sizeof(sample->info));
+    sample->info.frames     = (sf_count_t)h->frames;
+    sample->info.channels   = (int)h->channels;
+    sample->info.samplerate = (int)self->rate;
+    sample->data            = (float*)((uint8_t*)map + h->data_offset);
+    sample->map             = map;
+    sample->map_len         = map_len;
+    if (h->has_overview) {
+        memcpy(sample->overview, h->overview, sizeof(sample->overview));
+        atomic_store(&sample->overview_ready, true);
+    }
+    atomic_store(&sample->ready, sample->info.frames);
+    return true;
+}
+
+// Write a decoded sample to the cache, failures only cost the next load
+static void
+store_cached_sample(Syncrose*          self,
+                    const char*        path,
+                    const struct stat* st,
+                    const Sample*      sample)
+{
+    char cache_path[PATH_MAX];
+    char tmp_path[PATH_MAX + 8];
+    if (!get_cache_path(self, path, cache_path, sizeof(cache_path))) {
+        return;
+    }
+
     const size_t path_len = strlen(path);
+    CacheHeader  h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version           = CACHE_VERSION;
+    h.channels          = 1;
+    h.frames            = (uint64_t)sample->info.frames;
+    h.source_size       = (uint64_t)st->st_size;
+    h.source_mtime_sec  = (int64_t)st->st_mtim.tv_sec;
+    h.source_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    h.rate              = self->rate;
+    h.path_len          = (uint32_t)path_len;
+    h.data_offset       = (uint32_t)(
+        (sizeof(h) + path_len + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN);
+    h.has_overview      = atomic_load(&sample->overview_ready);
+    if (h.has_overview) {
+        memcpy(h.overview, sample->overview, sizeof(h.overview));
+    }
 
-    lv2_log_trace(&self->logger, "Loading sample %s\n", path);
+    // A unique temporary, zones of a map may store the same file from
+    // several threads or instances at once
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", cache_path);
+    const int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return;
+    }
+
+    FILE* const f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    static const char zeros[CACHE_ALIGN] = { 0 };
+    const size_t      pad  = h.data_offset - sizeof(h) - path_len;
+    const size_t      size = sizeof(float) * (size_t)sample->info.frames;
+    const bool        ok   = (fwrite(&h, sizeof(h), 1, f) == 1 &&
+                              fwrite(path, 1, path_len, f) == path_len &&
+                              fwrite(zeros, 1, pad, f) == pad &&
+                              fwrite(sample->data, 1, size, f) == size);
+
+    // Rename into place so readers never see a partial file
+    if (fclose(f) || !ok || rename(tmp_path, cache_path)) {
+        lv2_log_trace(&self->logger, "Failed to cache %s\n", path);
+        unlink(tmp_path);
+    }
+}
+
+// Resample data to the host rate, returns the new buffer or NULL
+static float*
+resample(Syncrose*    self,
+         const float* data,
+         sf_count_t   frames,
+         int          rate,
+         sf_count_t*  out_frames)
+{
+    const double ratio = self->rate / rate;
+    const long   len   = (long)ceil(frames * ratio) + 1;
+    float* const out   = (float*)malloc(sizeof(float) * len);
+    if (!out) {
+        return NULL;
+    }
+
+    SRC_DATA src;
+    memset(&src, 0, sizeof(src));
+    src.data_in       = data;
+    src.data_out      = out;
+    src.input_frames  = (long)frames;
+    src.output_frames = len;
+    src.src_ratio     = ratio;
+
+    const int err = src_simple(&src, SRC_SINC_MEDIUM_QUALITY, 1);
+    if (err) {
+        lv2_log_error(&self->logger, "Failed to resample (%s)\n",
+                      src_strerror(err));
+        free(out);
+        return NULL;
+    }
+
+    *out_frames = src.output_frames_gen;
+    return out;
+}
+
+// True if a newer load request makes finishing load gen pointless
+static bool
+load_superseded(Syncrose* self, uint32_t gen)
+{
+    return gen && atomic_load(&self->load_gen) != gen;
+}
+
+// Overview column of frame i of frames
+static inline sf_count_t
+overview_column(sf_count_t i, sf_count_t frames)
+{
+    return i * OVERVIEW_COLUMNS / frames;
+}
+
+// Widen the (min, max) overview columns of frames [first, first + n) of
+// data by those frames, in the decode pass while they are still in cache.
+// Columns start at (0, 0), the ones at either end may span other frames.
+static void
+add_overview(float*       overview,
+             const float* data,
+             sf_count_t   frames,
+             sf_count_t   first,
+             sf_count_t   n)
+{
+    const sf_count_t end = first + n;
+    for (sf_count_t i = first; i < end;) {
+        const sf_count_t c    = overview_column(i, frames);
+        const sf_count_t next = (((c + 1) * frames + OVERVIEW_COLUMNS - 1)
+                                 / OVERVIEW_COLUMNS);
+        const sf_count_t stop = next < end ? next : end;
+        float            lo   = overview[2 * c];
+        float            hi   = overview[2 * c + 1];
+        for (; i < stop; ++i) {
+            lo = fminf(lo, data[i]);
+            hi = fmaxf(hi, data[i]);
+        }
+        overview[2 * c]     = lo;
+        overview[2 * c + 1] = hi;
+    }
+}
+
+// Parallel decode of a large file, see decode_parallel()
+typedef struct DecodeJob {
+    Syncrose*       self;
+    Sample*         sample;
+    char*           path;
+    struct stat     st;
+    sf_count_t      n_chunks;
+    _Atomic sf_count_t next_chunk;    // Next chunk for a thread to claim
+    atomic_bool     cancel;           // Stop decoding, set when freeing
+    pthread_mutex_t mutex;            // Protects everything below
+    pthread_cond_t  cond;             // Signalled as chunks complete
+    uint8_t*        done;             // Completed chunks, 2 if read short
+    sf_count_t      ready_chunks;     // Completed chunks from the head
+    bool            failed;           // A chunk read short, do not cache
+    unsigned        n_threads;
+    pthread_t       threads[PARALLEL_MAX_THREADS];
+} DecodeJob;
+
+// Mark a chunk decoded, merging its overview columns into the sample
+static void
+finish_chunk(DecodeJob* job, sf_count_t chunk, bool ok, const float* cols)
+{
+    Sample* const    sample = job->sample;
+    const sf_count_t frames = sample->info.frames;
+    const sf_count_t first  = chunk * PARALLEL_CHUNK;
+    const sf_count_t last   = (first + PARALLEL_CHUNK < frames
+                               ? first + PARALLEL_CHUNK : frames) - 1;
+
+    pthread_mutex_lock(&job->mutex);
+    for (sf_count_t c = overview_column(first, frames);
+         c <= overview_column(last, frames); ++c) {
+        sample->overview[2 * c] = fminf(sample->overview[2 * c], cols[2 * c]);
+        sample->overview[2 * c + 1] = fmaxf(sample->overview[2 * c + 1],
+                                            cols[2 * c + 1]);
+    }
+    job->done[chunk] = ok ? 1 : 2;
+    job->failed      = job->failed || !ok;
+    while (job->ready_chunks < job->n_chunks && job->done[job->ready_chunks]) {
+        ++job->ready_chunks;
+    }
+    const sf_count_t ready    = job->ready_chunks * PARALLEL_CHUNK;
+    const bool       complete = (job->ready_chunks == job->n_chunks);
+    const bool       failed   = job->failed;
+
+    // Publish the contiguous decoded head to run() under the lock, so a
+    // thread finishing an earlier chunk can never store a shorter head
+    // after a later one
+    atomic_store(&sample->ready,
+                 ready < sample->info.frames ? ready : sample->info.frames);
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+
+    // The thread finishing the tail caches the complete sample, unless
+    // part of it is missing and would be cached as silence
+    if (complete) {
+        lv2_log_trace(&job->self->logger, "Decoded %s\n", job->path);
+        atomic_store_explicit(&sample->overview_ready, true,
+                              memory_order_release);
+        if (!failed) {
+            store_cached_sample(job->self, job->path, &job->st, sample);
+        }
+    }
+}
+
+// Decode thread, claims chunks and reads each with its own handle
+static void*
+decode_thread(void* arg)
+{
+    DecodeJob* const job    = (DecodeJob*)arg;
+    Sample* const    sample = job->sample;
+    SF_INFO          info;
+    memset(&info, 0, sizeof(info));
+    SNDFILE* const sndfile = sf_open(job->path, SFM_READ, &info);
+
+    while (!atomic_load(&job->cancel)) {
+        const sf_count_t chunk = atomic_fetch_add(&job->next_chunk, 1);
+        if (chunk >= job->n_chunks) {
+            break;
+        }
+
+        const sf_count_t first = chunk * PARALLEL_CHUNK;
+        const sf_count_t left  = sample->info.frames - first;
+        const sf_count_t n     = left < PARALLEL_CHUNK ? left : PARALLEL_CHUNK;
+        float* const     dst   = sample->data + first;
+        sf_count_t       got   = 0;
+        if (sndfile && sf_seek(sndfile, first, SEEK_SET) == first) {
+            got = sf_read_float(sndfile, dst, n);
+        }
+        if (got < n) {
+            lv2_log_error(&job->self->logger, "Short read from %s\n",
+                          job->path);
+            memset(dst + (got > 0 ? got : 0), 0,
+                   sizeof(float) * (n - (got > 0 ? got : 0)));
+        }
+
+        // Overview of this chunk alone, merged with its neighbours' later
+        float cols[2 * OVERVIEW_COLUMNS];
+        memset(cols, 0, sizeof(cols));
+        add_overview(cols, sample->data, sample->info.frames, first, n);
+
+        finish_chunk(job, chunk, got == n, cols);
+    }
+
+    if (sndfile) {
+        sf_close(sndfile);
+    }
+    return NULL;
+}
+
+// Stop a parallel decode and release it, only from non-realtime threads
+static void
+free_decode_job(DecodeJob* job)
+{
+    atomic_store(&job->cancel, true);
+    for (unsigned i = 0; i < job->n_threads; ++i) {
+        pthread_join(job->threads[i], NULL);
+    }
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->mutex);
+    free(job->done);
+    free(job->path);
+    free(job);
+}
+
+// Decode a large seekable file with one thread per core, writing straight
+// into the sample buffer.  Returns once the head chunk is ready, the tail
+// keeps decoding in the background and run() plays what is ready.
+static bool
+decode_parallel(Syncrose*          self,
+                const char*        path,
+                const struct stat* st,
+                uint32_t           gen,
+                Sample*            sample)
+{
+    const sf_count_t frames = sample->info.frames;
+    const long       cores  = sysconf(_SC_NPROCESSORS_ONLN);
+
+    DecodeJob* const job = (DecodeJob*)calloc(1, sizeof(DecodeJob));
+    sample->data = (float*)malloc(sizeof(float) * frames);
+    if (!job || !sample->data) {
+        lv2_log_error(&self->logger, "Failed to allocate memory for sample\n");
+        free(job);
+        free(sample->data);
+        return false;
+    }
+
+    job->self     = self;
+    job->sample   = sample;
+    job->path     = strdup(path);
+    job->st       = *st;
+    job->n_chunks = (frames + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    job->done     = (uint8_t*)calloc(job->n_chunks, 1);
+    atomic_init(&job->next_chunk, 0);
+    atomic_init(&job->cancel, false);
+    atomic_init(&sample->ready, 0);
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    unsigned n_threads = cores > 1 ? (unsigned)cores : 1;
+    if (n_threads > PARALLEL_MAX_THREADS) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+    if (n_threads > job->n_chunks) {
+        n_threads = (unsigned)job->n_chunks;
+    }
+    for (unsigned i = 0; i < n_threads && job->path && job->done; ++i) {
+        if (!pthread_create(&job->threads[job->n_threads], NULL,
+                            decode_thread, job)) {
+            ++job->n_threads;
+        }
+    }
+    if (!job->n_threads) {
+        lv2_log_error(&self->logger, "Failed to start decoding '%s'\n", path);
+        free_decode_job(job);
+        free(sample->data);
+        return false;
+    }
 
-    Sample* const  sample  = (Sample*)malloc(sizeof(Sample));
+    // Wait for the head, polling so a newer request can cut this short
+    pthread_mutex_lock(&job->mutex);
+    while (!job->ready_chunks && !load_superseded(self, gen)) {
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 10000000;
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_nsec -= 1000000000;
+            ++timeout.tv_sec;
+        }
+        pthread_cond_timedwait(&job->cond, &job->mutex, &timeout);
+    }
+    const bool failed = (job->ready_chunks && job->done[0] != 1);
+    pthread_mutex_unlock(&job->mutex);
+
+    // A short read of the head means the file is unreadable, fail the load
+    // rather than play silence.  Later failures only leave silent chunks.
+    if (failed) {
+        lv2_log_error(&self->logger, "Failed to decode '%s'\n", path);
+    }
+    if (failed || load_superseded(self, gen)) {
+        free_decode_job(job);
+        free(sample->data);
+        return false;
+    }
+
+    sample->job = job;
+    return true;
+}
+
+// Decode a sample with sndfile and resample it to the host rate.  Zones of
+// a map are decoded serially, as the map spreads its zones across threads,
+// and without an overview.
+static bool
+decode_sample(Syncrose*          self,
+              const char*        path,
+              const struct stat* st,
+              uint32_t           gen,
+              bool               zone,
+              Sample*            sample)
+{
     SF_INFO* const info    = &sample->info;
     SNDFILE* const sndfile = sf_open(path, SFM_READ, info);
 
     if (!sndfile || !info->frames || (info->channels != 1)) {
         lv2_log_error(&self->logger, "Failed to open sample '%s'\n", path);
-        free(sample);
-        return NULL;
+        if (sndfile) {
+            sf_close(sndfile);
+        }
+        return false;
+    }
+
+    // Large files that need no resampling are decoded in parallel
+    if (!zone &&
+        info->seekable &&
+        info->frames >= PARALLEL_MIN_FRAMES &&
+        info->samplerate == (int)self->rate &&
+        sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        sf_close(sndfile);
+        return decode_parallel(self, path, st, gen, sample);
     }
 
     // Read data
-    float* const data = malloc(sizeof(float) * info->frames);
+    float* data = malloc(sizeof(float) * info->frames);
     if (!data) {
         lv2_log_error(&self->logger, "Failed to allocate memory for sample\n");
-        return NULL;
+        sf_close(sndfile);
+        return false;
     }
     sf_seek(sndfile, 0ul, SEEK_SET);
-    sf_read_float(sndfile, data, info->frames);
+
+    // Read in chunks so a newer request can cut the decode short
+    sf_count_t done  = 0;
+    bool       whole = true;
+    while (done < info->frames && !load_superseded(self, gen)) {
+        const sf_count_t left = info->frames - done;
+        const sf_count_t n    = sf_read_float(
+            sndfile, data + done, left < DECODE_CHUNK ? left : DECODE_CHUNK);
+        if (n <= 0) {
+            lv2_log_error(&self->logger, "Short read from %s\n", path);
+            memset(data + done, 0, sizeof(float) * left);
+            done  = info->frames;
+            whole = false;
+        } else {
+            if (!zone) {
+                add_overview(sample->overview, data, info->frames, done, n);
+            }
+            done += n;
+        }
+    }
     sf_close(sndfile);
 
+    if (done < info->frames || load_superseded(self, gen)) {
+        free(data);
+        return false;
+    }
+
+    // Resample to host rate
+    if (info->samplerate != (int)self->rate) {
+        sf_count_t   frames    = 0;
+        float* const resampled = resample(self, data, info->frames,
+                                          info->samplerate, &frames);
+        free(data);
+        if (!resampled) {
+            return false;
+        }
+        data             = resampled;
+        info->frames     = frames;
+        info->samplerate = (int)self->rate;
+    }
+
+    // The overview was taken before resampling, its columns only depend on
+    // the position in the sample
+    sample->data = data;
+    atomic_store(&sample->ready, info->frames);
+    atomic_store_explicit(&sample->overview_ready, !zone, memory_order_release);
+    if (whole) {
+        sample->source_st = *st;
+        sample->uncached  = true;
+    }
+    return true;
+}
+
+static void
+free_sample(Syncrose* self, Sample* sample);
+
+// Write a sample decoded serially to the cache, if it is not there yet
+static void
+cache_sample(Syncrose* self, Sample* sample)
+{
+    if (sample->uncached) {
+        store_cached_sample(self, sample->path, &sample->source_st, sample);
+        sample->uncached = false;
+    }
+}
+
+// Compute the STFT used by the spectral engine, in the worker the first
+// time spectral mode is used with a fully decoded sample
+static void
+analyse_sample(Syncrose* self, Sample* sample)
+{
+    const sf_count_t frames = sample->info.frames;
+    if (frames > SPECTRAL_MAX_FRAMES) {
+        lv2_log_note(&self->logger,
+                     "Sample too long for spectral mode, not analysing\n");
+        return;
+    }
+
+    const uint32_t     n_frames = (uint32_t)(frames / SPECTRAL_HOP) + 1;
+    FFTPlan            plan;
+    SpectralBin* const spectrum = (SpectralBin*)malloc(
+        sizeof(SpectralBin) * SPECTRAL_BINS * (size_t)n_frames);
+    float* const       re       = (float*)malloc(sizeof(float) * SPECTRAL_SIZE);
+    float* const       im       = (float*)malloc(sizeof(float) * SPECTRAL_SIZE);
+    if (!spectrum || !re || !im || !fft_plan_init(&plan, SPECTRAL_SIZE)) {
+        lv2_log_error(&self->logger, "Failed to allocate memory for STFT\n");
+        free(spectrum);
+        free(re);
+        free(im);
+        return;
+    }
+
+    for (uint32_t f = 0; f < n_frames; ++f) {
+        // Windowed frame centred on f * SPECTRAL_HOP
+        const sf_count_t first = (sf_count_t)f * SPECTRAL_HOP - SPECTRAL_SIZE / 2;
+        for (uint32_t i = 0; i < SPECTRAL_SIZE; ++i) {
+            const sf_count_t j = first + i;
+            re[i] = (j >= 0 && j < frames) ? sample->data[j] * self->spec_window[i]
+                                           : 0.0f;
+            im[i] = 0.0f;
+        }
+        fft_run(&plan, re, im, false);
+
+        SpectralBin* const bins = spectrum + (size_t)f * SPECTRAL_BINS;
+        for (uint32_t k = 0; k < SPECTRAL_BINS; ++k) {
+            const float mag   = hypotf(re[k], im[k]);
+            const float level = (SPECTRAL_MAG_ZERO
+                                 + SPECTRAL_MAG_STEPS * log2f(mag));
+            const float phase = atan2f(im[k], re[k]) * (32768.0f / (float)M_PI);
+            bins[k].mag   = (uint16_t)fminf(fmaxf(rintf(level), 0.0f), 65535.0f);
+            bins[k].phase = (int16_t)fminf(fmaxf(rintf(phase), -32768.0f),
+                                           32767.0f);
+        }
+    }
+
+    fft_plan_free(&plan);
+    free(re);
+    free(im);
+
+    sample->spectrum        = spectrum;
+    sample->spectrum_frames = n_frames;
+    atomic_store_explicit(&sample->analysed, true, memory_order_release);
+}
+
+// Magnitude of a compact STFT bin
+static inline float
+bin_magnitude(SpectralBin bin)
+{
+    return bin.mag ? exp2f((bin.mag - SPECTRAL_MAG_ZERO) / SPECTRAL_MAG_STEPS)
+                   : 0.0f;
+}
+
+// Phase of a compact STFT bin
+static inline float
+bin_phase(SpectralBin bin)
+{
+    return bin.phase * ((float)M_PI / 32768.0f);
+}
+
+// Load a sample, gen is the request generation or 0 if not cancellable and
+// zone is true for the zones of a map, see decode_sample()
+static Sample*
+load_sample(Syncrose* self, const char* path, uint32_t gen, bool zone)
+{
+    const size_t path_len = strlen(path);
+
+    lv2_log_trace(&self->logger, "Loading sample %s\n", path);
+
+    Sample* const sample = (Sample*)calloc(1, sizeof(Sample));
+    if (!sample) {
+        lv2_log_error(&self->logger, "Failed to allocate memory for sample\n");
+        return NULL;
+    }
+    atomic_init(&sample->analysed, false);
+    atomic_init(&sample->worker_refs, 0);
+    atomic_init(&sample->overview_ready, false);
+
+    struct stat st;
+    if (stat(path, &st)) {
+        lv2_log_error(&self->logger, "Failed to open sample '%s'\n", path);
+        free(sample);
+        return NULL;
+    }
+
+    // Use the cached decode if possible, otherwise decode and cache it
+    if (!load_cached_sample(self, path, &st, sample) &&
+        !decode_sample(self, path, &st, gen, zone, sample)) {
+        if (load_superseded(self, gen)) {
+            lv2_log_note(&self->logger,
+                         "Abandoned loading %s, superseded\n", path);
+        }
+        free(sample);
+        return NULL;
+    }
+
     // Fill sample struct and return it
-    sample->data     = data;
     sample->path     = (char*)malloc(path_len + 1);
     sample->path_len = (uint32_t)path_len;
     memcpy(sample->path, path, path_len + 1);
 
+    // A sample first cached as a zone has no overview, take it from the map
+    if (!zone && !atomic_load(&sample->overview_ready) && sample->map) {
+        add_overview(sample->overview, sample->data, sample->info.frames,
+                     0, sample->info.frames);
+        atomic_store_explicit(&sample->overview_ready, true,
+                              memory_order_release);
+    }
+
+    // Requests are cached once the worker has replied, see work()
+    if (!gen) {
+        cache_sample(self, sample);
+    }
+
     return sample;
 }
 
@@ -119,12 +1158,217 @@ free_sample(Syncrose* self, Sample* sample)
 {
     if (sample) {
         lv2_log_trace(&self->logger, "Freeing %s\n", sample->path);
+        if (sample->job) {
+            free_decode_job(sample->job);
+        }
         free(sample->path);
-        free(sample->data);
+        free(sample->spectrum);
+        if (sample->map) {
+            munmap(sample->map, sample->map_len);
+        } else {
+            free(sample->data);
+        }
         free(sample);
     }
 }
 
+static void
+free_sample_map(Syncrose* self, SampleMap* map)
+{
+    if (map) {
+        lv2_log_trace(&self->logger, "Freeing map %s\n", map->path);
+        for (uint32_t z = 0; z < map->n_zones; ++z) {
+            free_sample(self, map->zones[z].sample);
+            free(map->zones[z].path);
+        }
+        free(map->path);
+        free(map);
+    }
+}
+
+// Parallel load of the zones of a map, see load_sample_map().  Zones are
+// the unit of parallelism, each is decoded serially.
+typedef struct {
+    Syncrose*   self;
+    SampleMap*  map;
+    uint32_t    gen;
+    atomic_uint next_zone;  // Next zone for a thread to claim
+} ZoneJob;
+
+static void*
+load_zone_thread(void* arg)
+{
+    ZoneJob* const job = (ZoneJob*)arg;
+    for (;;) {
+        const uint32_t z = atomic_fetch_add(&job->next_zone, 1);
+        if (z >= job->map->n_zones || load_superseded(job->self, job->gen)) {
+            break;
+        }
+        Zone* const zone = &job->map->zones[z];
+        zone->sample = load_sample(job->self, zone->path, job->gen, true);
+    }
+    return NULL;
+}
+
+// Parse one map line "lo_key hi_key lo_vel hi_vel root_key path" into a
+// zone, with path relative to the directory of the map file
+static bool
+parse_zone(const char* dir, size_t dir_len, const char* line, Zone* zone)
+{
+    int lo_key;
+    int hi_key;
+    int lo_vel;
+    int hi_vel;
+    int root;
+    int offset = 0;
+    if (sscanf(line, "%d %d %d %d %d %n",
+               &lo_key, &hi_key, &lo_vel, &hi_vel, &root, &offset) != 5 ||
+        !offset || lo_key < 0 || hi_key > 127 || lo_key > hi_key ||
+        lo_vel < 0 || hi_vel > 127 || lo_vel > hi_vel ||
+        root < 0 || root > 127) {
+        return false;
+    }
+
+    const char* file = line + offset;
+    size_t      len  = strlen(file);
+    while (len && (file[len - 1] == '\n' || file[len - 1] == '\r' ||
+                   file[len - 1] == ' ' || file[len - 1] == '\t')) {
+        --len;
+    }
+    if (!len) {
+        return false;
+    }
+
+    const size_t prefix = file[0] == '/' ? 0 : dir_len;
+    zone->path = (char*)malloc(prefix + len + 1);
+    if (!zone->path) {
+        return false;
+    }
+    memcpy(zone->path, dir, prefix);
+    memcpy(zone->path + prefix, file, len);
+    zone->path[prefix + len] = '\0';
+
+    zone->lo_key = (uint8_t)lo_key;
+    zone->hi_key = (uint8_t)hi_key;
+    zone->lo_vel = (uint8_t)lo_vel;
+    zone->hi_vel = (uint8_t)hi_vel;
+    zone->root   = (uint8_t)root;
+    return true;
+}
+
+// Load a sample map file, one zone per line and # for comments.  Zones are
+// loaded in parallel and the map only succeeds if every zone does, gen is
+// the request generation or 0 if not cancellable.  Zone lines are read
+// from zones instead of the file if not NULL, see restore().
+static SampleMap*
+load_sample_map(Syncrose*   self,
+                const char* path,
+                const char* zones,
+                uint32_t    gen)
+{
+    lv2_log_trace(&self->logger, "Loading sample map %s\n", path);
+
+    FILE* const f = (zones ? fmemopen((void*)zones, strlen(zones), "r")
+                     : fopen(path, "r"));
+    if (!f) {
+        lv2_log_error(&self->logger, "Failed to open sample map '%s'\n", path);
+        return NULL;
+    }
+
+    SampleMap* const map = (SampleMap*)calloc(1, sizeof(SampleMap));
+    const size_t     path_len = strlen(path);
+    if (!map || !(map->path = (char*)malloc(path_len + 1))) {
+        lv2_log_error(&self->logger, "Failed to allocate memory for map\n");
+        free(map);
+        fclose(f);
+        return NULL;
+    }
+    memcpy(map->path, path, path_len + 1);
+    map->path_len = (uint32_t)path_len;
+
+    const char* const slash   = strrchr(path, '/');
+    const size_t      dir_len = slash ? (size_t)(slash - path) + 1 : 0;
+
+    char     line[PATH_MAX + 64];
+    unsigned line_num = 0;
+    bool     ok       = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        ++line_num;
+        const char* p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\r' || !*p) {
+            continue;
+        } else if (map->n_zones == MAX_ZONES) {
+            lv2_log_error(&self->logger, "%s: More than %d zones\n",
+                          path, MAX_ZONES);
+            ok = false;
+        } else if (!parse_zone(path, dir_len, p, &map->zones[map->n_zones])) {
+            lv2_log_error(&self->logger, "%s:%u: Invalid zone\n",
+                          path, line_num);
+            ok = false;
+        } else {
+            ++map->n_zones;
+        }
+    }
+    fclose(f);
+
+    if (ok && !map->n_zones) {
+        lv2_log_error(&self->logger, "%s: No zones\n", path);
+        ok = false;
+    }
+
+    // Load zones on up to one thread per core, this thread included
+    if (ok) {
+        ZoneJob job = { self, map, gen, 0 };
+        atomic_init(&job.next_zone, 0);
+
+        const long cores     = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned   n_threads = cores > 1 ? (unsigned)cores - 1 : 0;
+        if (n_threads > PARALLEL_MAX_THREADS) {
+            n_threads = PARALLEL_MAX_THREADS;
+        }
+        if (n_threads > map->n_zones - 1) {
+            n_threads = map->n_zones - 1;
+        }
+
+        pthread_t threads[PARALLEL_MAX_THREADS];
+        unsigned  started = 0;
+        for (unsigned i = 0; i < n_threads; ++i) {
+            if (!pthread_create(&threads[started], NULL,
+                                load_zone_thread, &job)) {
+                ++started;
+            }
+        }
+        load_zone_thread(&job);
+        for (unsigned i = 0; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (uint32_t z = 0; z < map->n_zones && ok; ++z) {
+            ok = (map->zones[z].sample != NULL);
+        }
+    }
+
+    if (!ok) {
+        if (load_superseded(self, gen)) {
+            lv2_log_note(&self->logger,
+                         "Abandoned loading %s, superseded\n", path);
+        }
+        free_sample_map(self, map);
+        return NULL;
+    }
+
+    // Later zones take priority where zones overlap
+    for (uint32_t z = 0; z < map->n_zones; ++z) {
+        const Zone* const zone = &map->zones[z];
+        for (unsigned k = zone->lo_key; k <= zone->hi_key; ++k) {
+            memset(&map->table[k][zone->lo_vel], (int)(z + 1),
+                   zone->hi_vel - zone->lo_vel + 1u);
+        }
+    }
+
+    return map;
+}
+
 // Thread for non-realtime file loading
 static LV2_Worker_Status
 work(LV2_Handle                  instance,
@@ -139,50 +1383,275 @@ work(LV2_Handle                  instance,
         // Free old sample
         const SampleMessage* msg = (const SampleMessage*)data;
         free_sample(self, msg->sample);
-    } else {
+    } else if (atom->type == self->uris.analyseSample) {
+        // Analyse a sample for the spectral engine, freeing it is queued
+        // after this so it stays valid until done
+        const SampleMessage* msg = (const SampleMessage*)data;
+        analyse_sample(self, msg->sample);
+        atomic_fetch_sub_explicit(&msg->sample->worker_refs, 1,
+                                  memory_order_release);
+    } else if (atom->type == self->uris.freeSampleMap) {
+        const SampleMapMessage* msg = (const SampleMapMessage*)data;
+        free_sample_map(self, msg->map);
+    } else if (atom->type == self->uris.loadSample) {
         // Handle set message (load sample).
-        const LV2_Atom_Object* obj = (const LV2_Atom_Object*)data;
+        const LoadMessage*     msg = (const LoadMessage*)data;
+        const LV2_Atom_Object* obj = (const LV2_Atom_Object*)(msg + 1);
+        LoadResponse           res = { NULL, NULL, msg->gen };
+
+        if (msg->superseded) {
+            lv2_log_note(&self->logger,
+                         "Skipped %u superseded sample requests\n",
+                         msg->superseded);
+        }
+
+        // Get file path from message and load it, unless already stale
+        LV2_URID        key       = 0;
+        const LV2_Atom* file_path = read_set_path(&self->uris, obj, &key);
+        if (file_path && !load_superseded(self, msg->gen) &&
+            key == self->uris.sampleMap) {
+            res.map = load_sample_map(self, LV2_ATOM_BODY_CONST(file_path),
+                                      NULL, msg->gen);
+        } else if (file_path && !load_superseded(self, msg->gen)) {
+            res.sample = load_sample(self, LV2_ATOM_BODY_CONST(file_path),
+                                     msg->gen, false);
+        } else if (file_path) {
+            lv2_log_note(&self->logger, "Abandoned loading %s, superseded\n",
+                         (const char*)LV2_ATOM_BODY_CONST(file_path));
+        }
 
-        // Get file path from message
-        const LV2_Atom* file_path = read_set_file(&self->uris, obj);
-        if (!file_path) {
-            return LV2_WORKER_ERR_UNKNOWN;
+        // The reply hands the samples to run(), which frees them through
+        // the worker after this job, but restore() may free them directly
+        Sample*  loaded[MAX_ZONES];
+        uint32_t n_loaded = 0;
+        if (res.sample) {
+            loaded[n_loaded++] = res.sample;
+        } else if (res.map) {
+            for (uint32_t z = 0; z < res.map->n_zones; ++z) {
+                loaded[n_loaded++] = res.map->zones[z].sample;
+            }
+        }
+        for (uint32_t i = 0; i < n_loaded; ++i) {
+            atomic_fetch_add(&loaded[i]->worker_refs, 1);
         }
 
-        // Load sample.
-        Sample* sample = load_sample(self, LV2_ATOM_BODY_CONST(file_path));
-        if (sample) {
-            // Loaded sample, send it to run() to be applied.
-            respond(handle, sizeof(sample), &sample);
+        // Always reply, run() waits for this before sending another request
+        respond(handle, sizeof(res), &res);
+
+        // Cache new decodes only now, so the disk write never delays the
+        // sample becoming audible, and not while a newer request waits
+        for (uint32_t i = 0; i < n_loaded; ++i) {
+            if (!load_superseded(self, msg->gen)) {
+                cache_sample(self, loaded[i]);
+            }
+            atomic_fetch_sub_explicit(&loaded[i]->worker_refs, 1,
+                                      memory_order_release);
         }
+    } else {
+        return LV2_WORKER_ERR_UNKNOWN;
     }
 
     return LV2_WORKER_SUCCESS;
 }
 
+// Send the pending load request to the worker.  If the host can not take
+// it now it stays pending and run() tries again next cycle.
+static void
+send_pending_load(Syncrose* self)
+{
+    LoadMessage* const msg = (LoadMessage*)self->pending_load;
+    msg->superseded = self->load_superseded;
+
+    if (self->schedule->schedule_work(self->schedule->handle,
+                                      lv2_atom_total_size(&msg->atom),
+                                      msg) != LV2_WORKER_SUCCESS) {
+        return;
+    }
+
+    self->loading         = true;
+    self->load_pending    = false;
+    self->load_superseded = 0;
+}
+
+// Queue a sample change, replacing any request not yet sent to the worker
+static void
+request_sample(Syncrose* self, const LV2_Atom* set)
+{
+    const uint32_t size = lv2_atom_total_size(set);
+    if (sizeof(LoadMessage) + size > sizeof(self->pending_load)) {
+        lv2_log_error(&self->logger, "Sample set message too large\n");
+        return;
+    }
+
+    if (self->load_pending) {
+        ++self->load_superseded;
+    }
+
+    // Bumping the generation also tells the worker to abandon its decode
+    LoadMessage* const msg = (LoadMessage*)self->pending_load;
+    msg->atom.type = self->uris.loadSample;
+    msg->atom.size = sizeof(LoadMessage) - sizeof(LV2_Atom) + size;
+    msg->gen       = atomic_fetch_add(&self->load_gen, 1) + 1;
+    memcpy(msg + 1, set, size);
+    self->load_pending = true;
+
+    if (!self->loading) {
+        send_pending_load(self);
+    }
+}
+
+// Send a sample or sample map to the worker to be freed
+static LV2_Worker_Status
+schedule_free(Syncrose*                  self,
+              const LV2_Worker_Schedule* schedule,
+              Sample*                    sample,
+              SampleMap*                 map)
+{
+    if (map) {
+        SampleMapMessage msg = { { sizeof(SampleMap*),
+                                   self->uris.freeSampleMap },
+                                 map };
+        return schedule->schedule_work(schedule->handle, sizeof(msg), &msg);
+    }
+
+    SampleMessage msg = { { sizeof(Sample*), self->uris.freeSample },
+                          sample };
+    return schedule->schedule_work(schedule->handle, sizeof(msg), &msg);
+}
+
+// Wait until no worker job reads sample, only from non-realtime threads
+static void
+wait_sample_idle(const Sample* sample)
+{
+    while (sample && atomic_load_explicit(&sample->worker_refs,
+                                          memory_order_acquire)) {
+        usleep(1000);
+    }
+}
+
+// Tell the UI which sample or sample map is loaded
+static void
+write_source(Syncrose* self, int64_t frames)
+{
+    if (self->sample_map) {
+        lv2_atom_forge_frame_time(&self->forge, frames);
+        write_set_path(&self->forge, &self->uris, self->uris.sampleMap,
+                       self->sample_map->path,
+                       self->sample_map->path_len);
+    } else if (self->sample) {
+        lv2_atom_forge_frame_time(&self->forge, frames);
+        write_set_file(&self->forge, &self->uris,
+                       self->sample->path,
+                       self->sample->path_len);
+    }
+}
+
 static LV2_Worker_Status
 work_response(LV2_Handle  instance,
               uint32_t    size,
               const void* data)
 {
-    Syncrose* self = (Syncrose*)instance;
+    Syncrose*           self = (Syncrose*)instance;
+    const LoadResponse* res  = (const LoadResponse*)data;
+
+    self->loading = false;
+
+    if ((res->sample || res->map) &&
+        res->gen != atomic_load(&self->load_gen)) {
+        // A newer request or a state restore came in while loading, drop it
+        schedule_free(self, self->schedule, res->sample, res->map);
+    } else if (res->sample || res->map) {
+        // Free the current sample or map, grains reading it go with it
+        schedule_free(self, self->schedule, self->sample, self->sample_map);
+        memset(&self->pool, 0, sizeof(self->pool));
+
+        // Install the new sample, or the first zone until a note picks one
+        self->sample_map    = res->map;
+        self->sample        = res->map ? res->map->zones[0].sample : res->sample;
+        self->key_pitch     = 1.0f;
+        self->overview_sent = false;
+
+        // Send a notification that we're using a new sample.
+        write_source(self, self->frame_offset);
+    }
 
-    SampleMessage msg = { { sizeof(Sample*), self->uris.freeSample },
-                          self->sample };
+    // Last writer wins, only the newest request is ever sent
+    if (self->load_pending) {
+        send_pending_load(self);
+    }
 
-    // Send a message to the worker to free the current sample
-    self->schedule->schedule_work(self->schedule->handle, sizeof(msg), &msg);
+    return LV2_WORKER_SUCCESS;
+}
 
-    // Install the new sample
-    self->sample = *(Sample*const*)data;
+// Zeroth order modified Bessel function, for the Kaiser window
+static double
+bessel_i0(double x)
+{
+    double sum  = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum  += term;
+    }
+    return sum;
+}
 
-    // Send a notification that we're using a new sample.
-    lv2_atom_forge_frame_time(&self->forge, self->frame_offset);
-    write_set_file(&self->forge, &self->uris,
-                   self->sample->path,
-                   self->sample->path_len);
+// Design a Kaiser windowed half-band lowpass with unity gain at DC
+static void
+halfband_init(HalfBand* hb, uint32_t taps)
+{
+    const double centre = 2.0 * taps - 1.0;
+    double       sum    = 0.0;
+    memset(hb, 0, sizeof(HalfBand));
+    hb->taps = taps;
+    for (uint32_t j = 0; j < 2 * taps; ++j) {
+        // Odd branch tap j is offset 2 * j - centre from the centre
+        const double d = 2.0 * j - centre;
+        const double r = d / (centre + 1.0);
+        const double w = (bessel_i0(HALFBAND_BETA * sqrt(1.0 - r * r))
+                          / bessel_i0(HALFBAND_BETA));
+        hb->coef[j] = (float)(w * sin(0.5 * M_PI * d) / (M_PI * d));
+        sum += hb->coef[j];
+    }
+    for (uint32_t j = 0; j < 2 * taps; ++j) {
+        hb->coef[j] *= (float)(0.5 / sum);
+    }
+}
 
-    return LV2_WORKER_SUCCESS;
+// Clear the history of a decimator
+static void
+halfband_reset(HalfBand* hb)
+{
+    memset(hb->even, 0, sizeof(hb->even));
+    memset(hb->odd, 0, sizeof(hb->odd));
+}
+
+// Decimate 2 * n frames of in to n frames of out, n <= 2 * OVERSAMPLE_CHUNK.
+// Latency is taps - 1 output frames.
+static void
+halfband_decimate(HalfBand* hb, const float* in, float* out, uint32_t n)
+{
+    const uint32_t taps = hb->taps;
+    float* const   even = hb->even + taps - 1;
+    float* const   odd  = hb->odd + 2 * taps - 1;
+    for (uint32_t m = 0; m < n; ++m) {
+        even[m] = in[2 * m];
+        odd[m]  = in[2 * m + 1];
+    }
+
+    for (uint32_t m = 0; m < n; ++m) {
+        out[m] = 0.5f * hb->even[m];
+    }
+    for (uint32_t j = 0; j < 2 * taps; ++j) {
+        const float        c = hb->coef[j];
+        const float* const x = hb->odd + j;
+        for (uint32_t m = 0; m < n; ++m) {
+            out[m] += c * x[m];
+        }
+    }
+
+    memmove(hb->even, hb->even + n, sizeof(float) * (taps - 1));
+    memmove(hb->odd, hb->odd + n, sizeof(float) * (2 * taps - 1));
 }
 
 static void
@@ -195,17 +1664,77 @@ connect_port(LV2_Handle instance,
     case SYNCROSE_CONTROL:
         self->control_port = (const LV2_Atom_Sequence*)data;
         break;
-    case SYNCROSE_NOTIFY:
-        self->notify_port = (LV2_Atom_Sequence*)data;
+    case SYNCROSE_NOTIFY:
+        self->notify_port = (LV2_Atom_Sequence*)data;
+        break;
+    case SYNCROSE_OUT_L:
+        self->output_l_port = (float*)data;
+        break;
+    case SYNCROSE_OUT_R:
+        self->output_r_port = (float*)data;
+        break;
+    case SYNCROSE_START:
+        self->start_port = (float*)data;
+        break;
+    case SYNCROSE_STEP:
+        self->step_port = (float*)data;
+        break;
+    case SYNCROSE_LENGTH:
+        self->length_port = (float*)data;
+        break;
+    case SYNCROSE_RATE:
+        self->rate_port = (float*)data;
+        break;
+    case SYNCROSE_SYNC:
+        self->sync_port = (float*)data;
+        break;
+    case SYNCROSE_DIVISION:
+        self->division_port = (float*)data;
+        break;
+    case SYNCROSE_MODE:
+        self->mode_port = (float*)data;
+        break;
+    case SYNCROSE_PITCH:
+        self->pitch_port = (float*)data;
+        break;
+    case SYNCROSE_SPEED:
+        self->speed_port = (float*)data;
+        break;
+    case SYNCROSE_FILTER:
+        self->filter_port = (float*)data;
+        break;
+    case SYNCROSE_CUTOFF:
+        self->cutoff_port = (float*)data;
+        break;
+    case SYNCROSE_SPREAD:
+        self->spread_port = (float*)data;
         break;
-    case SYNCROSE_OUT:
-        self->output_port = (float*)data;
+    case SYNCROSE_RESONANCE:
+        self->resonance_port = (float*)data;
         break;
-    case SYNCROSE_START:
-        self->start_port = (float*)data;
+    case SYNCROSE_PAN:
+        self->pan_port = (float*)data;
         break;
-    case SYNCROSE_STEP:
-        self->step_port = (float*)data;
+    case SYNCROSE_PAN_SPREAD:
+        self->pan_spread_port = (float*)data;
+        break;
+    case SYNCROSE_IN:
+        self->input_port = (const float*)data;
+        break;
+    case SYNCROSE_SOURCE:
+        self->source_port = (float*)data;
+        break;
+    case SYNCROSE_CAPTURE:
+        self->capture_port = (float*)data;
+        break;
+    case SYNCROSE_FREEZE:
+        self->freeze_port = (float*)data;
+        break;
+    case SYNCROSE_OVERSAMPLE:
+        self->oversample_port = (float*)data;
+        break;
+    case SYNCROSE_LATENCY:
+        self->latency_port = (float*)data;
         break;
     default:
         break;
@@ -248,21 +1777,81 @@ instantiate(const LV2_Descriptor*     descriptor,
     lv2_atom_forge_init(&self->forge, self->map);
     lv2_log_logger_init(&self->logger, self->map, self->log);
 
+    atomic_init(&self->load_gen, 0);
+
+    self->rate             = rate;
+    self->key_pitch        = 1.0f;
+    self->cache_dir        = get_cache_dir();
+    self->telemetry_period = (uint32_t)(rate / TELEMETRY_RATE);
+
+    // Hann window for grain envelopes
+    for (int i = 0; i <= WINDOW_SIZE; ++i) {
+        self->window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / WINDOW_SIZE);
+    }
+
+    // Capture ring for live input, allocated once up front
+    uint64_t ring_size = 1;
+    while (ring_size < (uint64_t)((MAX_CAPTURE_SECONDS + CAPTURE_MARGIN_SECONDS)
+                                  * rate)) {
+        ring_size <<= 1;
+    }
+    self->ring      = (float*)calloc(ring_size, sizeof(float));
+    self->ring_mask = ring_size - 1;
+    if (!self->ring) {
+        lv2_log_error(&self->logger, "Failed to allocate capture buffer\n");
+        goto fail;
+    }
+
+    // Constant power pan law
+    for (int i = 0; i <= PAN_SIZE; ++i) {
+        const float theta = 0.5f * (float)M_PI * i / PAN_SIZE;
+        self->pan_table[2 * i]     = cosf(theta);
+        self->pan_table[2 * i + 1] = sinf(theta);
+    }
+
+    // Decimators, only run when oversampling
+    for (int c = 0; c < 2; ++c) {
+        halfband_init(&self->decim[c][0], HALFBAND_FIRST_TAPS);
+        halfband_init(&self->decim[c][1], HALFBAND_TAPS);
+    }
+    self->oversample = 1;
+
+    // Spectral engine, Hann windows for analysis and synthesis
+    if (!fft_plan_init(&self->fft, SPECTRAL_SIZE)) {
+        lv2_log_error(&self->logger, "Failed to allocate FFT\n");
+        goto fail;
+    }
+    for (int i = 0; i < SPECTRAL_SIZE; ++i) {
+        self->spec_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i
+                                                  / SPECTRAL_SIZE);
+    }
+    self->spec_out_pos = SPECTRAL_HOP;
+
+    self->rng = 0x9E3779B9u ^ (uint32_t)(uintptr_t)self;
+    if (!self->rng) {
+        self->rng = 1;
+    }
+
+    // Transport defaults until the host tells us otherwise
+    self->bpm           = 120.0;
+    self->beats_per_bar = 4.0;
+    self->beat_unit     = 4.0;
+
     // Load the default sample file
     const size_t path_len    = strlen(path);
     const size_t file_len    = strlen(default_sample_file);
     const size_t len         = path_len + file_len;
     char*        sample_path = (char*)malloc(len + 1);
     snprintf(sample_path, len + 1, "%s%s", path, default_sample_file);
-    self->sample = load_sample(self, sample_path);
+    self->sample = load_sample(self, sample_path, 0, false);
     free(sample_path);
 
-    self->start = 0;
-    self->step  = self->sample->info.frames;
-
     return (LV2_Handle)self;
 
 fail:
+    fft_plan_free(&self->fft);
+    free(self->ring);
+    free(self->cache_dir);
     free(self);
     return 0;
 }
@@ -271,22 +1860,711 @@ static void
 cleanup(LV2_Handle instance)
 {
     Syncrose* self = (Syncrose*)instance;
-    free_sample(self, self->sample);
+    if (self->sample_map) {
+        free_sample_map(self, self->sample_map);
+    } else {
+        free_sample(self, self->sample);
+    }
+    fft_plan_free(&self->fft);
+    free(self->ring);
+    free(self->cache_dir);
     free(self);
 }
 
+// Length of the grain source, the capture window in live mode
+static sf_count_t
+source_frames(const Syncrose* self)
+{
+    if (self->live) {
+        return (sf_count_t)self->capture_len;
+    }
+    return self->sample ? self->sample->info.frames : 0;
+}
+
+// Source position of the first source frame, in live mode ring positions
+// start capture_len before the write head
+static double
+source_origin(const Syncrose* self)
+{
+    return self->live ? (double)self->live_now - self->capture_len : 0.0;
+}
+
+// Position in the loop region for a beat when synced
+static double
+sync_position(const Syncrose* self, double beat)
+{
+    const sf_count_t frames = source_frames(self);
+    const double     avail  = fmax(1.0, frames - self->loop_start);
+
+    double loop_beat = fmod(beat, self->loop_beats);
+    if (loop_beat < 0.0) {
+        loop_beat += self->loop_beats;
+    }
+
+    return self->loop_start + fmod(loop_beat * self->frames_per_beat, avail);
+}
+
+// Emit a decimated snapshot of the playback state to the UI, within budget
+static void
+emit_telemetry(Syncrose* self, uint32_t budget, uint32_t sample_count)
+{
+    if (self->telemetry_countdown > sample_count) {
+        self->telemetry_countdown -= sample_count;
+        return;
+    }
+    self->telemetry_countdown = self->telemetry_period;
+
+    // Skip the frame if idle and the UI knows it
+    const GrainPool* const pool   = &self->pool;
+    const sf_count_t       frames = source_frames(self);
+    const double           origin = source_origin(self);
+    const uint32_t         n      = frames ? pool->count : 0;
+    if (!n && !self->telemetry_active) {
+        return;
+    }
+    self->telemetry_active = (n > 0);
+
+    // Collect active grains, decimated to fit the budget and the UI
+    const uint32_t base = telemetry_size(0);
+    if (budget < base) {
+        return;
+    }
+    uint32_t fit = (budget - base) / (2 * sizeof(float));
+    if (fit > TELEMETRY_MAX_GRAINS) {
+        fit = TELEMETRY_MAX_GRAINS;
+    }
+    const uint32_t stride = (n > fit) ? (n + fit - 1) / (fit ? fit : 1) : 1;
+    uint32_t       out    = 0;
+    for (uint32_t i = 0; i < n && fit; i += stride, ++out) {
+        self->telemetry[2 * out] = (float)((pool->pos[i] - origin) / frames);
+        self->telemetry[2 * out + 1] = pool->amp[i] *
+            self->window[(int)fminf(pool->phase[i], WINDOW_SIZE)];
+    }
+
+    const double head = self->synced
+        ? sync_position(self, self->beat)
+        : self->loop_start + self->head;
+    const float playhead = frames ? (float)(head / frames) : 0.0f;
+    lv2_atom_forge_frame_time(&self->forge, 0);
+    write_telemetry(&self->forge, &self->uris, playhead, self->telemetry, out);
+}
+
+static double
+atom_number(const SyncroseURIs* uris, const LV2_Atom* atom)
+{
+    if (atom->type == uris->atom_Float) {
+        return ((const LV2_Atom_Float*)atom)->body;
+    } else if (atom->type == uris->atom_Double) {
+        return ((const LV2_Atom_Double*)atom)->body;
+    } else if (atom->type == uris->atom_Int) {
+        return ((const LV2_Atom_Int*)atom)->body;
+    } else if (atom->type == uris->atom_Long) {
+        return (double)((const LV2_Atom_Long*)atom)->body;
+    }
+    return 0.0;
+}
+
+// Update transport state from a time:Position object
+static void
+update_position(Syncrose* self, const LV2_Atom_Object* obj)
+{
+    const SyncroseURIs* uris     = &self->uris;
+    const LV2_Atom*     bar      = NULL;
+    const LV2_Atom*     bar_beat = NULL;
+    const LV2_Atom*     bpb      = NULL;
+    const LV2_Atom*     unit     = NULL;
+    const LV2_Atom*     bpm      = NULL;
+    const LV2_Atom*     speed    = NULL;
+    lv2_atom_object_get(obj,
+                        uris->time_bar,            &bar,
+                        uris->time_barBeat,        &bar_beat,
+                        uris->time_beatsPerBar,    &bpb,
+                        uris->time_beatUnit,       &unit,
+                        uris->time_beatsPerMinute, &bpm,
+                        uris->time_speed,          &speed,
+                        0);
+
+    if (bpm) {
+        self->bpm = atom_number(uris, bpm);
+    }
+    if (speed) {
+        self->speed = atom_number(uris, speed);
+    }
+    if (bpb) {
+        self->beats_per_bar = atom_number(uris, bpb);
+    }
+    if (unit) {
+        self->beat_unit = atom_number(uris, unit);
+    }
+    if (bar_beat) {
+        const double beat = atom_number(uris, bar_beat) +
+            (bar ? atom_number(uris, bar) * self->beats_per_bar : 0.0);
+
+        // A position we did not predict is a relocation, re-phase the grid
+        if (fabs(beat - self->beat) > 1e-3) {
+            self->next_beat_valid = false;
+        }
+        self->beat         = beat;
+        self->has_position = true;
+    }
+}
+
+// Derive grain parameters from control ports and transport state
+static void
+update_params(Syncrose* self)
+{
+    const bool live = (*self->source_port >= SOURCE_LIVE - 0.5f);
+    if (live != self->live) {
+        // Grain positions mean something else in the new source, drop them
+        memset(&self->pool, 0, sizeof(self->pool));
+        self->live = live;
+    }
+    const uint32_t oversample = (*self->oversample_port >= 3.0f ? 4
+                                 : *self->oversample_port >= 1.5f ? 2 : 1);
+    if (oversample != self->oversample) {
+        // Grains and decimator history are at the old mix rate
+        memset(&self->pool, 0, sizeof(self->pool));
+        for (int c = 0; c < 2; ++c) {
+            halfband_reset(&self->decim[c][0]);
+            halfband_reset(&self->decim[c][1]);
+        }
+        self->oversample = oversample;
+        self->latency    = (oversample == 1 ? 0
+                            : oversample == 2 ? HALFBAND_TAPS - 1
+                            : HALFBAND_TAPS - 1 + (HALFBAND_FIRST_TAPS - 1) / 2);
+    }
+
+    self->freeze      = (*self->freeze_port > 0.5f);
+    self->capture_len = self->rate * fmin(fmax(*self->capture_port, 0.1f),
+                                          MAX_CAPTURE_SECONDS);
+
+    const sf_count_t frames = source_frames(self);
+    const double     start  = fmin(fmax(*self->start_port, 0.0f), 1.0f);
+    const double     step   = fmin(fmax(*self->step_port, 0.0f), 1.0f);
+    const double     length = fmax(1.0, *self->length_port * self->rate / 1000.0);
+
+    self->pitch    = self->key_pitch * exp2f(fminf(fmaxf(*self->pitch_port,
+                                                         -24.0f), 24.0f) / 12.0f);
+    // The STFT is only computed once spectral mode is used with a fully
+    // decoded sample, grains play until the worker has analysed it
+    Sample* const sample   = self->sample;
+    const bool    spectral = (*self->mode_port >= MODE_SPECTRAL - 0.5f &&
+                              !live && sample);
+    if (spectral && !sample->analysis_requested &&
+        atomic_load(&sample->ready) == sample->info.frames) {
+        SampleMessage msg = { { sizeof(Sample*), self->uris.analyseSample },
+                              sample };
+        atomic_fetch_add(&sample->worker_refs, 1);
+        sample->analysis_requested = (
+            self->schedule->schedule_work(self->schedule->handle,
+                                          sizeof(msg), &msg)
+            == LV2_WORKER_SUCCESS);
+        if (!sample->analysis_requested) {
+            atomic_fetch_sub(&sample->worker_refs, 1);
+        }
+    }
+    self->spectral = (spectral && atomic_load_explicit(&sample->analysed,
+                                                       memory_order_acquire));
+
+    self->filter        = (int)fminf(fmaxf(*self->filter_port, FILTER_OFF),
+                                     FILTER_HIGHPASS);
+    self->cutoff        = fminf(fmaxf(*self->cutoff_port, 20.0f), 20000.0f);
+    self->cutoff_spread = fminf(fmaxf(*self->spread_port, 0.0f), 4.0f);
+    self->filter_k      = 2.0f - 2.0f * fminf(fmaxf(*self->resonance_port,
+                                                    0.0f), 0.97f);
+
+    self->pan        = 0.5f + 0.5f * fminf(fmaxf(*self->pan_port, -1.0f), 1.0f);
+    self->pan_spread = fminf(fmaxf(*self->pan_spread_port, 0.0f), 1.0f);
+
+    self->loop_start = floor(start * frames);
+    self->loop_len   = fmax(1.0, step * (frames - self->loop_start));
+    self->interval   = self->rate / fmax(*self->rate_port, 0.1f);
+
+    // Overlap is kept when synced, so grains stretch with the grid
+    const double overlap = length / self->interval;
+    self->grain_amp      = 1.0f / (float)fmax(1.0, 0.5 * overlap);
+
+    const bool synced = (*self->sync_port > 0.5f && self->has_position &&
+                         self->speed > 0.0 && self->bpm > 0.0 &&
+                         self->beat_unit > 0.0 && self->beats_per_bar > 0.0);
+    if (synced != self->synced) {
+        self->next_beat_valid = false;
+    }
+    self->synced = synced;
+
+    if (synced) {
+        const double division = fmax(1.0, floor(*self->division_port));
+        const double interval = self->beat_unit / division;
+        if (interval != self->interval_beats) {
+            self->next_beat_valid = false;
+        }
+        self->interval_beats  = interval;
+        self->loop_beats      = fmax(interval,
+                                     round(step * self->beats_per_bar / interval)
+                                     * interval);
+        self->frames_per_beat = 60.0 * self->rate / self->bpm;
+        self->grain_len       = (overlap * interval * self->frames_per_beat
+                                 / self->speed);
+    } else {
+        self->grain_len = length;
+    }
+}
+
+// Compute grain onsets for the next n frames and advance the clocks
+static uint32_t
+schedule_onsets(Syncrose* self, uint32_t n)
+{
+    const double bpf   = self->speed * self->bpm / (60.0 * self->rate);
+    uint32_t     count = 0;
+
+    if (self->synced) {
+        if (!self->next_beat_valid) {
+            self->next_beat = self->interval_beats *
+                ceil(self->beat / self->interval_beats - 1e-6);
+            self->next_beat_valid = true;
+        }
+        for (;;) {
+            const double offset = ceil((self->next_beat - self->beat) / bpf - 1e-6);
+            if (offset >= n) {
+                break;
+            } else if (count < MAX_ONSETS) {
+                self->onsets[count].frame = offset > 0.0 ? (uint32_t)offset : 0;
+                self->onsets[count].pos   = sync_position(self, self->next_beat);
+                ++count;
+            }
+            self->next_beat += self->interval_beats;
+        }
+    } else {
+        for (; self->next_onset < n; self->next_onset += self->interval) {
+            if (count < MAX_ONSETS) {
+                self->onsets[count].frame = (uint32_t)self->next_onset;
+                self->onsets[count].pos   = self->loop_start + fmod(
+                    self->head + self->next_onset, self->loop_len);
+                ++count;
+            }
+        }
+        self->next_onset -= n;
+        self->head = fmod(self->head + n, self->loop_len);
+    }
+
+    self->beat += n * bpf;
+    return count;
+}
+
+// Uniform random number in [0, 1) from a xorshift generator
+static float
+random_unit(Syncrose* self)
+{
+    uint32_t x = self->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->rng = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+static void
+spawn_grain(Syncrose* self, double pos)
+{
+    GrainPool* const pool = &self->pool;
+    if (pool->count == MAX_GRAINS) {
+        return;
+    }
+
+    const uint32_t g = pool->count++;
+    pool->pos[g]    = pos;
+    pool->src[g]    = self->live ? NULL : self->sample;
+    pool->last[g]   = self->live ? INFINITY : (double)(atomic_load_explicit(
+        &self->sample->ready, memory_order_acquire) - 1);
+    pool->inc[g]    = self->pitch / self->oversample;
+    pool->amp[g]    = self->grain_amp;
+    pool->phase[g]  = 0.0f;
+    pool->dphase[g] = (float)(WINDOW_SIZE / (self->grain_len * self->oversample));
+
+    // Pan spread randomly around the centre, gains from the pan table
+    const float pan = fminf(fmaxf(self->pan + self->pan_spread *
+                                  (random_unit(self) - 0.5f), 0.0f), 1.0f);
+    const int   idx = (int)(pan * PAN_SIZE + 0.5f);
+    pool->gain_l[g] = self->pan_table[2 * idx];
+    pool->gain_r[g] = self->pan_table[2 * idx + 1];
+
+    // Filter cutoff is spread randomly in octaves around the cutoff port
+    const float spread = self->cutoff_spread * (2.0f * random_unit(self) - 1.0f);
+    const float cutoff = fminf(self->cutoff * exp2f(spread),
+                               0.49f * (float)self->rate);
+    const float w      = tanf((float)M_PI * cutoff
+                              / (float)(self->rate * self->oversample));
+    const float k      = self->filter_k;
+    pool->a1[g]  = 1.0f / (1.0f + w * (w + k));
+    pool->a2[g]  = w * pool->a1[g];
+    pool->a3[g]  = w * pool->a2[g];
+    pool->ic1[g] = 0.0f;
+    pool->ic2[g] = 0.0f;
+
+    switch (self->filter) {
+    case FILTER_LOWPASS:
+        pool->m0[g] = 0.0f;
+        pool->m1[g] = 0.0f;
+        pool->m2[g] = 1.0f;
+        break;
+    case FILTER_BANDPASS:
+        pool->m0[g] = 0.0f;
+        pool->m1[g] = k;
+        pool->m2[g] = 0.0f;
+        break;
+    case FILTER_HIGHPASS:
+        pool->m0[g] = 1.0f;
+        pool->m1[g] = -k;
+        pool->m2[g] = -1.0f;
+        break;
+    default:
+        pool->m0[g] = 1.0f;
+        pool->m1[g] = 0.0f;
+        pool->m2[g] = 0.0f;
+        break;
+    }
+}
+
+// Remove grain g, moving the last grain into its lane and silencing that
+static void
+retire_grain(GrainPool* pool, uint32_t g)
+{
+    const uint32_t last = --pool->count;
+
+    pool->pos[g]    = pool->pos[last];
+    pool->last[g]   = pool->last[last];
+    pool->src[g]    = pool->src[last];
+    pool->inc[g]    = pool->inc[last];
+    pool->amp[g]    = pool->amp[last];
+    pool->phase[g]  = pool->phase[last];
+    pool->dphase[g] = pool->dphase[last];
+    pool->gain_l[g] = pool->gain_l[last];
+    pool->gain_r[g] = pool->gain_r[last];
+    pool->a1[g]     = pool->a1[last];
+    pool->a2[g]     = pool->a2[last];
+    pool->a3[g]     = pool->a3[last];
+    pool->m0[g]     = pool->m0[last];
+    pool->m1[g]     = pool->m1[last];
+    pool->m2[g]     = pool->m2[last];
+    pool->ic1[g]    = pool->ic1[last];
+    pool->ic2[g]    = pool->ic2[last];
+
+    pool->x[last]   = 0.0f;
+    pool->ic1[last] = 0.0f;
+    pool->ic2[last] = 0.0f;
+}
+
+// Resynthesise the next hop of the spectral engine into spec_out
+static void
+synthesise_hop(Syncrose* self)
+{
+    const Sample* const sample = self->sample;
+    float* const        re     = self->spec_re;
+    float* const        im     = self->spec_im;
+
+    // Shift out the finished hop
+    memcpy(self->spec_out, self->spec_ola, sizeof(float) * SPECTRAL_HOP);
+    memmove(self->spec_ola, self->spec_ola + SPECTRAL_HOP,
+            sizeof(float) * (SPECTRAL_SIZE - SPECTRAL_HOP));
+    memset(self->spec_ola + SPECTRAL_SIZE - SPECTRAL_HOP, 0,
+           sizeof(float) * SPECTRAL_HOP);
+    self->spec_out_pos = 0;
+
+    if (!self->play || !sample ||
+        !atomic_load_explicit(&sample->analysed, memory_order_acquire)) {
+        return;
+    }
+
+    // Interpolate magnitudes between the two nearest analysis frames
+    const uint32_t     last   = sample->spectrum_frames - 1;
+    const uint32_t     f0     = (uint32_t)fmin(self->spec_pos, last);
+    const uint32_t     f1     = f0 < last ? f0 + 1 : f0;
+    const float        frac   = (float)(self->spec_pos - floor(self->spec_pos));
+    const SpectralBin* bins0  = sample->spectrum + (size_t)f0 * SPECTRAL_BINS;
+    const SpectralBin* bins1  = sample->spectrum + (size_t)f1 * SPECTRAL_BINS;
+    const float        pitch  = self->pitch;
+    float* const       mag    = self->spec_mag;
+    float* const       phase0 = self->spec_phase0;
+    uint32_t* const    peak   = self->spec_peak;
+
+    for (uint32_t k = 0; k < SPECTRAL_BINS; ++k) {
+        const float mag0 = bin_magnitude(bins0[k]);
+        mag[k]    = mag0 + frac * (bin_magnitude(bins1[k]) - mag0);
+        phase0[k] = bin_phase(bins0[k]);
+        re[k]     = 0.0f;
+        im[k]     = 0.0f;
+    }
+
+    // Find the nearest magnitude peak of each bin
+    uint32_t prev = UINT32_MAX;
+    for (uint32_t k = 0; k < SPECTRAL_BINS; ++k) {
+        const bool is_peak = ((k == 0 || mag[k] > mag[k - 1]) &&
+                              (k == SPECTRAL_BINS - 1 || mag[k] >= mag[k + 1]));
+        prev    = is_peak ? k : prev;
+        peak[k] = prev;
+    }
+    uint32_t next = UINT32_MAX;
+    for (uint32_t k = SPECTRAL_BINS; k-- > 0;) {
+        next = (peak[k] == k) ? k : next;
+        if (peak[k] == UINT32_MAX || (next != UINT32_MAX &&
+                                      next - k < k - peak[k])) {
+            peak[k] = next;
+        }
+    }
+
+    // Each peak moves to its pitch shifted bin and advances at its measured
+    // frequency scaled by pitch, the bins around it move along and keep
+    // their analysed phase offsets (phase locking)
+    for (uint32_t k = 0; k < SPECTRAL_BINS; ++k) {
+        const uint32_t target = (uint32_t)(k * pitch + 0.5f);
+        if (peak[k] == k && target < SPECTRAL_BINS) {
+            const float expected = 2.0f * (float)M_PI * k * SPECTRAL_HOP
+                / SPECTRAL_SIZE;
+            float delta = bin_phase(bins1[k]) - phase0[k] - expected;
+            delta -= 2.0f * (float)M_PI * rintf(delta / (2.0f * (float)M_PI));
+
+            float phase = self->spec_phase[target] + (expected + delta) * pitch;
+            phase -= 2.0f * (float)M_PI * rintf(phase / (2.0f * (float)M_PI));
+            self->spec_phase[target] = phase;
+        }
+    }
+    for (uint32_t k = 0; k < SPECTRAL_BINS; ++k) {
+        const uint32_t p      = peak[k];
+        const uint32_t shift  = (uint32_t)(p * pitch + 0.5f);
+        const uint32_t target = k + shift - p;
+        if (shift < SPECTRAL_BINS && target < SPECTRAL_BINS) {
+            const float phase = (self->spec_phase[shift] +
+                                 phase0[k] - phase0[p]);
+            re[target] += mag[k] * cosf(phase);
+            im[target] += mag[k] * sinf(phase);
+        }
+    }
+    for (uint32_t k = SPECTRAL_BINS; k < SPECTRAL_SIZE; ++k) {
+        re[k] = re[SPECTRAL_SIZE - k];
+        im[k] = -im[SPECTRAL_SIZE - k];
+    }
+    fft_run(&self->fft, re, im, true);
+
+    // Hann analysis and synthesis windows at 75% overlap sum to 1.5
+    const float scale = 1.0f / (SPECTRAL_SIZE * 1.5f);
+    for (uint32_t i = 0; i < SPECTRAL_SIZE; ++i) {
+        self->spec_ola[i] += re[i] * self->spec_window[i] * scale;
+    }
+
+    // Advance through the loop region, a speed of zero freezes time
+    const double speed      = fmax(*self->speed_port, 0.0f);
+    const double loop_first = self->loop_start / SPECTRAL_HOP;
+    const double loop_len   = fmax(1.0, self->loop_len / SPECTRAL_HOP);
+    self->spec_pos += speed;
+    if (self->spec_pos >= loop_first + loop_len) {
+        self->spec_pos = loop_first + fmod(self->spec_pos - loop_first, loop_len);
+    }
+}
+
+// Add n frames of the spectral engine to the outputs, panned to the centre
+// and delayed by the decimator latency
+static void
+render_spectral(Syncrose* self, float* out_l, float* out_r, uint32_t n)
+{
+    const int   idx    = (int)(self->pan * PAN_SIZE + 0.5f);
+    const float gain_l = self->pan_table[2 * idx];
+    const float gain_r = self->pan_table[2 * idx + 1];
+    for (uint32_t i = 0; i < n; ++i) {
+        if (self->spec_out_pos == SPECTRAL_HOP) {
+            synthesise_hop(self);
+        }
+        const uint32_t w = self->spec_delay_pos++ & (SPECTRAL_DELAY - 1);
+        self->spec_delay[w] = self->spec_out[self->spec_out_pos++];
+
+        const float x = self->spec_delay[(w - self->latency)
+                                         & (SPECTRAL_DELAY - 1)];
+        out_l[i] += gain_l * x;
+        out_r[i] += gain_r * x;
+    }
+}
+
+// Mix grains for the n host frames from first into n * oversample frames
+// of out, spawning grains at onsets from *next on
+static void
+mix_grains(Syncrose* self,
+           float*    out_l,
+           float*    out_r,
+           uint32_t  first,
+           uint32_t  n,
+           uint32_t  n_onsets,
+           uint32_t* next,
+           uint64_t  mask,
+           double    lag)
+{
+    GrainPool* const pool = &self->pool;
+    const uint32_t   os   = self->oversample;
+    for (uint32_t i = 0; i < n * os; ++i) {
+        for (; *next < n_onsets &&
+                 self->onsets[*next].frame * os <= first * os + i; ++*next) {
+            if (!self->play || self->spectral) {
+                continue;
+            } else if (self->live) {
+                const double now = ((double)self->live_now
+                                    + (self->freeze ? 0.0
+                                       : first + (double)i / os));
+                spawn_grain(self, fmin(now - self->capture_len
+                                       + self->onsets[*next].pos,
+                                       now - lag));
+            } else {
+                spawn_grain(self, self->onsets[*next].pos);
+            }
+        }
+
+        // Read and window each grain, retiring finished ones
+        for (uint32_t g = 0; g < pool->count;) {
+            if (pool->phase[g] >= WINDOW_SIZE ||
+                pool->pos[g] >= pool->last[g]) {
+                retire_grain(pool, g);
+                continue;
+            }
+
+            const float*   data = pool->src[g] ? pool->src[g]->data : self->ring;
+            const double   pos  = floor(pool->pos[g]);
+            const uint64_t idx  = (uint64_t)(int64_t)pos;
+            const float    frac = (float)(pool->pos[g] - pos);
+            const float    x0   = data[idx & mask];
+            const float    x    = x0 + frac * (data[(idx + 1) & mask] - x0);
+            pool->x[g] = x * self->window[(int)pool->phase[g]] * pool->amp[g];
+
+            pool->pos[g]   += pool->inc[g];
+            pool->phase[g] += pool->dphase[g];
+            ++g;
+        }
+
+        // Filter, pan and mix GRAIN_LANES grains at a time, one per lane
+        const uint32_t lanes = ((pool->count + GRAIN_LANES - 1)
+                                / GRAIN_LANES * GRAIN_LANES);
+        float          sum_l[GRAIN_LANES] = { 0.0f };
+        float          sum_r[GRAIN_LANES] = { 0.0f };
+        for (uint32_t j = 0; j < lanes; j += GRAIN_LANES) {
+            for (uint32_t l = 0; l < GRAIN_LANES; ++l) {
+                const uint32_t g  = j + l;
+                const float    v0 = pool->x[g];
+                const float    v3 = v0 - pool->ic2[g];
+                const float    v1 = pool->a1[g] * pool->ic1[g] + pool->a2[g] * v3;
+                const float    v2 = (pool->ic2[g] + pool->a2[g] * pool->ic1[g]
+                                     + pool->a3[g] * v3);
+                pool->ic1[g] = 2.0f * v1 - pool->ic1[g];
+                pool->ic2[g] = 2.0f * v2 - pool->ic2[g];
+                const float    y  = (pool->m0[g] * v0 + pool->m1[g] * v1
+                                     + pool->m2[g] * v2);
+                sum_l[l] += pool->gain_l[g] * y;
+                sum_r[l] += pool->gain_r[g] * y;
+            }
+        }
+
+        float acc_l = 0.0f;
+        float acc_r = 0.0f;
+        for (uint32_t l = 0; l < GRAIN_LANES; ++l) {
+            acc_l += sum_l[l];
+            acc_r += sum_r[l];
+        }
+        out_l[i] = acc_l;
+        out_r[i] = acc_r;
+    }
+
+}
+
+// Decimate n host frames of channel c from the oversampled mix in
+static void
+decimate(Syncrose* self, int c, const float* in, float* out, uint32_t n)
+{
+    if (self->oversample == 4) {
+        halfband_decimate(&self->decim[c][0], in, self->os_mid, 2 * n);
+        in = self->os_mid;
+    }
+    halfband_decimate(&self->decim[c][1], in, out, n);
+}
+
+// Render n frames of grains, spawning new ones at precomputed onsets
+static void
+render(Syncrose* self, float* out_l, float* out_r, uint32_t n)
+{
+    const uint32_t n_onsets = schedule_onsets(self, n);
+    const Sample*  sample   = self->sample;
+    if (!sample && !self->live) {
+        memset(out_l, 0, sizeof(float) * n);
+        memset(out_r, 0, sizeof(float) * n);
+        return;
+    }
+
+    // Live grains wrap around the ring and start far enough behind the
+    // write head that they never reach it.  Sample grains may only read
+    // the decoded head of their sample while a load is in progress.
+    GrainPool* const pool = &self->pool;
+    uint64_t         mask = self->ring_mask;
+    double           lag  = 0.0;
+    if (!self->live) {
+        mask = UINT64_MAX;
+        for (uint32_t g = 0; g < pool->count; ++g) {
+            pool->last[g] = (double)(atomic_load_explicit(
+                &pool->src[g]->ready, memory_order_acquire) - 1);
+        }
+    } else {
+        // A frozen ring has no new input arriving during the grain.  Synced
+        // grains can be any length, but may never start further back than
+        // the margin the ring keeps beyond the capture window.
+        const double ahead = self->freeze ? self->pitch : self->pitch - 1.0;
+        lag = fmin(2.0 + self->grain_len * fmax(ahead, 0.0),
+                   CAPTURE_MARGIN_SECONDS * self->rate);
+    }
+
+    uint32_t next = 0;
+    if (self->oversample == 1) {
+        mix_grains(self, out_l, out_r, 0, n, n_onsets, &next, mask, lag);
+    } else {
+        // Mix a chunk at a time at the oversampled rate and decimate it
+        for (uint32_t first = 0; first < n; first += OVERSAMPLE_CHUNK) {
+            const uint32_t len = (n - first < OVERSAMPLE_CHUNK
+                                  ? n - first : OVERSAMPLE_CHUNK);
+            mix_grains(self, self->os_l, self->os_r,
+                       first, len, n_onsets, &next, mask, lag);
+            decimate(self, 0, self->os_l, out_l + first, len);
+            decimate(self, 1, self->os_r, out_r + first, len);
+        }
+    }
+
+    if (self->spectral) {
+        render_spectral(self, out_l, out_r, n);
+    }
+
+    if (self->live && !self->freeze) {
+        self->live_now += n;
+    }
+}
+
+// Point new grains at the zone of a note, false if no zone covers it
+static bool
+select_zone(Syncrose* self, uint8_t key, uint8_t velocity)
+{
+    const SampleMap* const map = self->sample_map;
+    const uint8_t          z   = map->table[key & 0x7F][velocity & 0x7F];
+    if (!z) {
+        return false;
+    }
+
+    const Zone* const zone = &map->zones[z - 1];
+    self->sample    = zone->sample;
+    self->key_pitch = exp2f(((int)(key & 0x7F) - zone->root) / 12.0f);
+    return true;
+}
+
 #define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
 
 static void
 run(LV2_Handle instance,
     uint32_t   sample_count)
 {
-    Syncrose*     self        = (Syncrose*)instance;
-    SyncroseURIs* uris        = &self->uris;
-    sf_count_t   start_frame = 0;
-    sf_count_t   pos         = 0;
-    float*       output      = self->output_port;
-
+    Syncrose*     self   = (Syncrose*)instance;
+    SyncroseURIs* uris   = &self->uris;
+    float*        out_l  = self->output_l_port;
+    float*        out_r  = self->output_r_port;
+    uint32_t      offset = 0;
 
     // Set up forge to write directly to notify output port.
     const uint32_t notify_capacity = self->notify_port->atom.size;
@@ -299,24 +2577,71 @@ run(LV2_Handle instance,
 
     // Send update to UI if sample has changed due to state restore
     if (self->sample_changed) {
-        lv2_atom_forge_frame_time(&self->forge, 0);
-        write_set_file(&self->forge, &self->uris,
-                       self->sample->path,
-                       self->sample->path_len);
+        write_source(self, 0);
         self->sample_changed = false;
     }
 
-    // Read incoming events
+    // Send the waveform overview once the sample is fully decoded, maps
+    // have none
+    if (!self->overview_sent && !self->sample_map && self->sample &&
+        atomic_load_explicit(&self->sample->overview_ready,
+                             memory_order_acquire) &&
+        notify_capacity - self->forge.offset >= overview_size()) {
+        lv2_atom_forge_frame_time(&self->forge, 0);
+        write_overview(&self->forge, &self->uris, self->sample->overview);
+        self->overview_sent = true;
+    }
+
+    // Send telemetry at a low fixed rate, using at most half the port
+    const uint32_t space = notify_capacity - self->forge.offset;
+    emit_telemetry(self,
+                   space < notify_capacity / 2 ? space : notify_capacity / 2,
+                   sample_count);
+
+    // Retry a load request the worker had no room for
+    if (self->load_pending && !self->loading) {
+        send_pending_load(self);
+    }
+
+    update_params(self);
+    if (self->latency_port) {
+        *self->latency_port = (float)self->latency;
+    }
+
+    // Capture input whenever not frozen, so switching to live granulates
+    // what was just played rather than a stale or empty ring.  It is the
+    // only copy input takes on its way to grains.
+    self->live_now = self->write_pos;
+    if (!self->freeze) {
+        const uint64_t first = self->write_pos & self->ring_mask;
+        const uint64_t room  = self->ring_mask + 1 - first;
+        const uint32_t head  = room < sample_count ? (uint32_t)room : sample_count;
+        memcpy(self->ring + first, self->input_port, sizeof(float) * head);
+        memcpy(self->ring, self->input_port + head,
+               sizeof(float) * (sample_count - head));
+        self->write_pos += sample_count;
+    }
+
+    // Read incoming events, rendering up to each one
     LV2_ATOM_SEQUENCE_FOREACH(self->control_port, ev) {
         self->frame_offset = ev->time.frames;
 
+        render(self, out_l + offset, out_r + offset,
+               self->frame_offset - offset);
+        offset = self->frame_offset;
+
         if (ev->body.type == uris->midi_Event) {
             const uint8_t* const msg = (const uint8_t*)(ev + 1);
             switch (lv2_midi_message_type(msg)) {
             case LV2_MIDI_MSG_NOTE_ON:
-                start_frame = ev->time.frames;
-                self->frame = (long)(*(self->start_port)/127 * (float)self->sample->info.frames);
-                self->play  = true;
+                if (self->sample_map && !select_zone(self, msg[1], msg[2])) {
+                    break;  // No zone for this key and velocity
+                }
+                update_params(self);
+                self->head       = 0.0;
+                self->next_onset = 0.0;
+                self->spec_pos   = self->loop_start / SPECTRAL_HOP;
+                self->play       = true;
                 break;
             case LV2_MIDI_MSG_NOTE_OFF:
                 self->play  = false;
@@ -326,7 +2651,11 @@ run(LV2_Handle instance,
             }
         } else if (lv2_atom_forge_is_object_type(&self->forge, ev->body.type)) {
             const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
-            if (obj->body.otype == uris->patch_Set) {
+            if (obj->body.otype == uris->time_Position) {
+                // Transport change, takes effect from this frame on
+                update_position(self, obj);
+                update_params(self);
+            } else if (obj->body.otype == uris->patch_Set) {
                 // Get the property and value of the set message
                 const LV2_Atom* property = NULL;
                 const LV2_Atom* value    = NULL;
@@ -345,12 +2674,10 @@ run(LV2_Handle instance,
                 }
 
                 const uint32_t key = ((const LV2_Atom_URID*)property)->body;
-                if (key == uris->sample) {
+                if (key == uris->sample || key == uris->sampleMap) {
                     // Sample change, send it to the worker.
                     lv2_log_trace(&self->logger, "Queueing set message\n");
-                    self->schedule->schedule_work(self->schedule->handle,
-                                                  lv2_atom_total_size(&ev->body),
-                                                  &ev->body);
+                    request_sample(self, &ev->body);
                 } else if (key == uris->param_gain) {
                     // Gain change
                     if (value->type == uris->atom_Float) {
@@ -360,10 +2687,8 @@ run(LV2_Handle instance,
             } else if (obj->body.otype == uris->patch_Get) {
                 // Received a get message, emit our state (probably to UI)
                 lv2_log_trace(&self->logger, "Responding to get request\n");
-                lv2_atom_forge_frame_time(&self->forge, self->frame_offset);
-                write_set_file(&self->forge, &self->uris,
-                               self->sample->path,
-                               self->sample->path_len);
+                write_source(self, self->frame_offset);
+                self->overview_sent = false;
             } else {
                 lv2_log_trace(&self->logger,
                               "Unknown object type %d\n", obj->body.otype);
@@ -374,45 +2699,85 @@ run(LV2_Handle instance,
         }
     }
 
-    // Render the sample (possibly already in progress)
-    if (self->play) {
-        uint32_t       f  = self->frame;
-        sf_count_t   calc_start  = (long)(*(self->start_port)/127 * (float)self->sample->info.frames);
-        sf_count_t   calc_step   = (long)(*(self->step_port)*10);
-        const uint32_t lf = self->sample->info.frames < calc_start + calc_step ?
-            self->sample->info.frames : calc_start + calc_step;
+    // Render the rest of the block
+    render(self, out_l + offset, out_r + offset, sample_count - offset);
+}
 
-        for (pos = 0; pos < start_frame; ++pos) {
-            output[pos] = 0;
+static LV2_State_Map_Path*
+get_map_path(LV2_Log_Logger* logger, const LV2_Feature* const* features)
+{
+    for (int i = 0; features[i]; ++i) {
+        if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
+            return (LV2_State_Map_Path*)features[i]->data;
         }
+    }
+    lv2_log_error(logger, "Missing map:path feature\n");
+    return NULL;
+}
 
-        for (; pos < sample_count && f < lf; ++pos, ++f) {
-            output[pos] = self->sample->data[f] * 1;
+// Rewrite each path of map file zone lines with a map:path function, to
+// save zones with abstract paths and restore them as absolute ones
+static char*
+map_zone_paths(const char* zones,
+               char* (*map_fn)(LV2_State_Map_Path_Handle, const char*),
+               LV2_State_Map_Path_Handle handle)
+{
+    char*       buf = NULL;
+    size_t      len = 0;
+    FILE* const in  = fmemopen((void*)zones, strlen(zones), "r");
+    FILE* const out = open_memstream(&buf, &len);
+    if (!in || !out) {
+        if (in) {
+            fclose(in);
+        }
+        if (out) {
+            fclose(out);
         }
+        free(buf);
+        return NULL;
+    }
 
-        self->frame = f;
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), in)) {
+        int keys[5];
+        int offset = 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%d %d %d %d %d %n", &keys[0], &keys[1],
+                   &keys[2], &keys[3], &keys[4], &offset) != 5 || !offset) {
+            continue;
+        }
 
-        if (f == lf) {
-            self->frame = calc_start;
+        char* const path = map_fn(handle, line + offset);
+        if (path) {
+            fprintf(out, "%d %d %d %d %d %s\n",
+                    keys[0], keys[1], keys[2], keys[3], keys[4], path);
+            free(path);
         }
     }
 
-    // Add zeros to end if sample not long enough (or not playing)
-    for (; pos < sample_count; ++pos) {
-        output[pos] = 0.0f;
-    }
+    fclose(in);
+    fclose(out);
+    return buf;
 }
 
-static LV2_State_Map_Path*
-get_map_path(LV2_Log_Logger* logger, const LV2_Feature* const* features)
+// Zones of a map as map file lines with absolute paths
+static char*
+write_zones(const SampleMap* map)
 {
-    for (int i = 0; features[i]; ++i) {
-        if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
-            return (LV2_State_Map_Path*)features[i]->data;
-        }
+    char*       buf = NULL;
+    size_t      len = 0;
+    FILE* const out = open_memstream(&buf, &len);
+    if (!out) {
+        return NULL;
     }
-    lv2_log_error(logger, "Missing map:path feature\n");
-    return NULL;
+    for (uint32_t z = 0; z < map->n_zones; ++z) {
+        const Zone* const zone = &map->zones[z];
+        fprintf(out, "%u %u %u %u %u %s\n",
+                zone->lo_key, zone->hi_key, zone->lo_vel, zone->hi_vel,
+                zone->root, zone->path);
+    }
+    fclose(out);
+    return buf;
 }
 
 static LV2_State_Status
@@ -432,18 +2797,47 @@ save(LV2_Handle                instance,
         return LV2_STATE_ERR_NO_FEATURE;
     }
 
-    // Map absolute sample path to an abstract state path
-    char* apath = map_path->abstract_path(map_path->handle, self->sample->path);
+    // Map absolute sample or map path to an abstract state path
+    const LV2_URID key   = (self->sample_map ? self->uris.sampleMap
+                            : self->uris.sample);
+    char*          apath = map_path->abstract_path(
+        map_path->handle,
+        self->sample_map ? self->sample_map->path : self->sample->path);
 
     // Path storage
     store(handle,
-          self->uris.sample,
+          key,
           apath,
           strlen(apath) + 1,
           self->uris.atom_Path,
           LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
 
     free(apath);
+
+    // A map is saved with its zones, each sample path mapped so the host
+    // can bundle the samples with the map and restore them as one unit
+    if (self->sample_map) {
+        char* const zones  = write_zones(self->sample_map);
+        char* const azones = (zones ? map_zone_paths(zones,
+                                                     map_path->abstract_path,
+                                                     map_path->handle)
+                              : NULL);
+        free(zones);
+        if (!azones) {
+            lv2_log_error(&self->logger, "Failed to save map zones\n");
+            return LV2_STATE_ERR_UNKNOWN;
+        }
+
+        store(handle,
+              self->uris.zones,
+              azones,
+              strlen(azones) + 1,
+              self->uris.atom_String,
+              LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+
+        free(azones);
+    }
+
     return LV2_STATE_SUCCESS;
 }
 
@@ -456,12 +2850,18 @@ restore(LV2_Handle                  instance,
 {
     Syncrose* self = (Syncrose*)instance;
 
-    // Obtain syncrose:sample
+    // Obtain syncrose:sampleMap, or syncrose:sample without a map
     size_t      size;
     uint32_t    type;
     uint32_t    valflags;
-    const void* value = retrieve(handle, self->uris.sample,
-                                 &size, &type, &valflags);
+    bool        is_map = true;
+    const void* value  = retrieve(handle, self->uris.sampleMap,
+                                  &size, &type, &valflags);
+    if (!value) {
+        is_map = false;
+        value  = retrieve(handle, self->uris.sample,
+                          &size, &type, &valflags);
+    }
     if (!value) {
         lv2_log_error(&self->logger, "Missing syncrose:sample\n");
         return LV2_STATE_ERR_NO_PROPERTY;
@@ -479,8 +2879,57 @@ restore(LV2_Handle                  instance,
     char*       path  = map_path->absolute_path(map_path->handle, apath);
 
     lv2_log_trace(&self->logger, "Restoring file %s\n", path);
-    free_sample(self, self->sample);
-    self->sample = load_sample(self, path);
+
+    // Restored state wins over any request still queued or in the worker,
+    // whose response is now stale and will be freed when it arrives
+    atomic_fetch_add(&self->load_gen, 1);
+    self->load_pending    = false;
+    self->load_superseded = 0;
+
+    // The worker may still be analysing the old sample or a zone of the old
+    // map.  Free it in the worker, after that analysis, if the host gives
+    // restore() a worker, otherwise wait for the analysis to finish here.
+    const LV2_Worker_Schedule* schedule = NULL;
+    for (int i = 0; features[i]; ++i) {
+        if (!strcmp(features[i]->URI, LV2_WORKER__schedule)) {
+            schedule = (const LV2_Worker_Schedule*)features[i]->data;
+        }
+    }
+    if (!schedule ||
+        schedule_free(self, schedule, self->sample, self->sample_map)
+        != LV2_WORKER_SUCCESS) {
+        if (self->sample_map) {
+            for (uint32_t z = 0; z < self->sample_map->n_zones; ++z) {
+                wait_sample_idle(self->sample_map->zones[z].sample);
+            }
+            free_sample_map(self, self->sample_map);
+        } else {
+            wait_sample_idle(self->sample);
+            free_sample(self, self->sample);
+        }
+    }
+    memset(&self->pool, 0, sizeof(self->pool));
+
+    if (is_map) {
+        // Zones saved with the map, else whatever the map file now holds
+        const void* azones = retrieve(handle, self->uris.zones,
+                                      &size, &type, &valflags);
+        char*       zones  = NULL;
+        if (azones && type == self->uris.atom_String) {
+            zones = map_zone_paths((const char*)azones,
+                                   map_path->absolute_path,
+                                   map_path->handle);
+        }
+        self->sample_map = load_sample_map(self, path, zones, 0);
+        free(zones);
+        self->sample     = (self->sample_map
+                            ? self->sample_map->zones[0].sample : NULL);
+    } else {
+        self->sample_map = NULL;
+        self->sample     = load_sample(self, path, 0, false);
+    }
+    self->key_pitch      = 1.0f;
+    self->overview_sent  = false;
     self->sample_changed = true;
 
     return LV2_STATE_SUCCESS;
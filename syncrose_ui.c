@@ -14,6 +14,8 @@
 
 #define SYNCROSE_UI_URI "http://kneit.in/plugins/syncrose#ui"
 
+#define WAVE_COLUMNS OVERVIEW_COLUMNS
+
 typedef struct {
 	LV2_Atom_Forge forge;
 
@@ -26,9 +28,63 @@ typedef struct {
 	GtkWidget* box;
 	GtkWidget* button;
 	GtkWidget* label;
+	GtkWidget* wave;
 	GtkWidget* window;
+
+	/* Waveform overview as (min, max) pairs per column, from the plugin. */
+	float peaks[2 * WAVE_COLUMNS];
+	bool  has_peaks;
+
+	/* Latest telemetry frame from the plugin. */
+	float    playhead;
+	float    grains[2 * TELEMETRY_MAX_GRAINS];
+	uint32_t n_grains;
 } SyncroseUI;
 
+static gboolean
+on_wave_expose(GtkWidget*      widget,
+               GdkEventExpose* event,
+               void*           handle)
+{
+	SyncroseUI*  ui = (SyncroseUI*)handle;
+	cairo_t*     cr = gdk_cairo_create(widget->window);
+	const double w  = widget->allocation.width;
+	const double h  = widget->allocation.height;
+
+	cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+	cairo_paint(cr);
+
+	/* Waveform. */
+	if (ui->has_peaks) {
+		cairo_set_source_rgb(cr, 0.4, 0.6, 0.8);
+		cairo_set_line_width(cr, 1.0);
+		for (int c = 0; c < WAVE_COLUMNS; ++c) {
+			const double x = (c + 0.5) * w / WAVE_COLUMNS;
+			cairo_move_to(cr, x, h * 0.5 * (1.0 - ui->peaks[2 * c + 1]));
+			cairo_line_to(cr, x, h * 0.5 * (1.0 - ui->peaks[2 * c]));
+		}
+		cairo_stroke(cr);
+	}
+
+	/* Grains, opacity follows amplitude. */
+	for (uint32_t g = 0; g < ui->n_grains; ++g) {
+		cairo_set_source_rgba(cr, 1.0, 0.7, 0.2, ui->grains[2 * g + 1]);
+		cairo_arc(cr, ui->grains[2 * g] * w, h * 0.5, 3.0, 0.0, 2.0 * M_PI);
+		cairo_fill(cr);
+	}
+
+	/* Playhead. */
+	if (ui->n_grains) {
+		cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+		cairo_move_to(cr, ui->playhead * w, 0.0);
+		cairo_line_to(cr, ui->playhead * w, h);
+		cairo_stroke(cr);
+	}
+
+	cairo_destroy(cr);
+	return TRUE;
+}
+
 static void
 on_load_clicked(GtkWidget* widget,
                 void*      handle)
@@ -85,7 +141,11 @@ instantiate(const LV2UI_Descriptor*   descriptor,
 	ui->box        = NULL;
 	ui->button     = NULL;
 	ui->label      = NULL;
+	ui->wave       = NULL;
 	ui->window     = NULL;
+	ui->has_peaks  = false;
+	ui->playhead   = 0.0f;
+	ui->n_grains   = 0;
 
 	*widget = NULL;
 
@@ -107,12 +167,18 @@ instantiate(const LV2UI_Descriptor*   descriptor,
 
 	ui->box = gtk_vbox_new(FALSE, 4);
 	ui->label = gtk_label_new("?");
+	ui->wave = gtk_drawing_area_new();
 	ui->button = gtk_button_new_with_label("Load Sample");
-	gtk_box_pack_start(GTK_BOX(ui->box), ui->label, TRUE, TRUE, 4);
+	gtk_widget_set_size_request(ui->wave, WAVE_COLUMNS, 96);
+	gtk_box_pack_start(GTK_BOX(ui->box), ui->label, FALSE, FALSE, 4);
+	gtk_box_pack_start(GTK_BOX(ui->box), ui->wave, TRUE, TRUE, 4);
 	gtk_box_pack_start(GTK_BOX(ui->box), ui->button, FALSE, FALSE, 4);
 	g_signal_connect(ui->button, "clicked",
 	                 G_CALLBACK(on_load_clicked),
 	                 ui);
+	g_signal_connect(ui->wave, "expose-event",
+	                 G_CALLBACK(on_wave_expose),
+	                 ui);
 
 	// Request state (filename) from plugin
 	uint8_t get_buf[512];
@@ -151,14 +217,47 @@ port_event(LV2UI_Handle handle,
 	if (format == ui->uris.atom_eventTransfer) {
 		const LV2_Atom* atom = (const LV2_Atom*)buffer;
 		if (lv2_atom_forge_is_object_type(&ui->forge, atom->type)) {
-			const LV2_Atom_Object* obj      = (const LV2_Atom_Object*)atom;
-			const LV2_Atom*        file_uri = read_set_file(&ui->uris, obj);
+			const LV2_Atom_Object* obj = (const LV2_Atom_Object*)atom;
+			if (obj->body.otype == ui->uris.Telemetry) {
+				/* New telemetry frame, redraw only now. */
+				const float* grains   = NULL;
+				uint32_t     n_grains = 0;
+				if (read_telemetry(&ui->uris, obj,
+				                   &ui->playhead, &grains, &n_grains)) {
+					ui->n_grains = (n_grains < TELEMETRY_MAX_GRAINS
+					                ? n_grains : TELEMETRY_MAX_GRAINS);
+					memcpy(ui->grains, grains,
+					       2 * sizeof(float) * ui->n_grains);
+					gtk_widget_queue_draw(ui->wave);
+				}
+				return;
+			} else if (obj->body.otype == ui->uris.Overview) {
+				/* Overview computed by the plugin once the sample decoded. */
+				const float* peaks = read_overview(&ui->uris, obj);
+				if (peaks) {
+					memcpy(ui->peaks, peaks, sizeof(ui->peaks));
+					ui->has_peaks = true;
+					gtk_widget_queue_draw(ui->wave);
+				}
+				return;
+			}
+
+
+			LV2_URID        key      = 0;
+			const LV2_Atom* file_uri = read_set_path(&ui->uris, obj, &key);
 			if (!file_uri) {
 				fprintf(stderr, "Unknown message sent to UI.\n");
 				return;
 			}
 
+			/* A sample map has no single waveform to show.  A different
+			   sample clears the old one until its overview arrives. */
 			const char* uri = (const char*)LV2_ATOM_BODY_CONST(file_uri);
+			if (key == ui->uris.sampleMap ||
+			    strcmp(uri, gtk_label_get_text(GTK_LABEL(ui->label)))) {
+				ui->has_peaks = false;
+				gtk_widget_queue_draw(ui->wave);
+			}
 			gtk_label_set_text(GTK_LABEL(ui->label), uri);
 		} else {
 			fprintf(stderr, "Unknown message type.\n");
@@ -198,7 +297,11 @@ ui_idle(LV2UI_Handle handle)
 {
 	SyncroseUI* ui = (SyncroseUI*)handle;
 	if (ui->window) {
-		gtk_main_iteration();
+		/* Handle pending events without blocking, drawing is
+		   only queued when a new telemetry frame arrives. */
+		while (gtk_events_pending()) {
+			gtk_main_iteration_do(FALSE);
+		}
 	}
 	return 0;
 }
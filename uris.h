@@ -5,62 +5,125 @@
 #include "lv2/lv2plug.in/ns/ext/midi/midi.h"
 #include "lv2/lv2plug.in/ns/ext/state/state.h"
 #include "lv2/lv2plug.in/ns/ext/parameters/parameters.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
 
 #define SYNCROSE_URI          "http://kneit.in/plugins/syncrose"
 #define SYNCROSE__sample      SYNCROSE_URI "#sample"
+#define SYNCROSE__sampleMap   SYNCROSE_URI "#sampleMap"
+#define SYNCROSE__zones       SYNCROSE_URI "#zones"
 #define SYNCROSE__applySample SYNCROSE_URI "#applySample"
+#define SYNCROSE__analyseSample SYNCROSE_URI "#analyseSample"
 #define SYNCROSE__freeSample  SYNCROSE_URI "#freeSample"
+#define SYNCROSE__freeSampleMap SYNCROSE_URI "#freeSampleMap"
+#define SYNCROSE__loadSample  SYNCROSE_URI "#loadSample"
+#define SYNCROSE__Telemetry   SYNCROSE_URI "#Telemetry"
+#define SYNCROSE__playhead    SYNCROSE_URI "#playhead"
+#define SYNCROSE__grains      SYNCROSE_URI "#grains"
+#define SYNCROSE__Overview    SYNCROSE_URI "#Overview"
+#define SYNCROSE__peaks       SYNCROSE_URI "#peaks"
+
+/* Columns of the waveform overview the plugin sends the UI. */
+#define OVERVIEW_COLUMNS 512
+
+/* Most grains in a telemetry frame, the plugin decimates to fit. */
+#define TELEMETRY_MAX_GRAINS 64
 
 typedef struct {
+	LV2_URID atom_Double;
 	LV2_URID atom_Float;
+	LV2_URID atom_Int;
+	LV2_URID atom_Long;
 	LV2_URID atom_Path;
 	LV2_URID atom_Resource;
 	LV2_URID atom_Sequence;
+	LV2_URID atom_String;
 	LV2_URID atom_URID;
+	LV2_URID atom_Vector;
 	LV2_URID atom_eventTransfer;
 	LV2_URID applySample;
+	LV2_URID analyseSample;
 	LV2_URID sample;
+	LV2_URID sampleMap;
+	LV2_URID zones;
 	LV2_URID freeSample;
+	LV2_URID freeSampleMap;
+	LV2_URID loadSample;
+	LV2_URID Telemetry;
+	LV2_URID playhead;
+	LV2_URID grains;
+	LV2_URID Overview;
+	LV2_URID peaks;
 	LV2_URID midi_Event;
 	LV2_URID param_gain;
 	LV2_URID patch_Get;
 	LV2_URID patch_Set;
 	LV2_URID patch_property;
 	LV2_URID patch_value;
+	LV2_URID time_Position;
+	LV2_URID time_bar;
+	LV2_URID time_barBeat;
+	LV2_URID time_beatUnit;
+	LV2_URID time_beatsPerBar;
+	LV2_URID time_beatsPerMinute;
+	LV2_URID time_speed;
 } SyncroseURIs;
 
 static inline void
 map_sampler_uris(LV2_URID_Map* map, SyncroseURIs* uris)
 {
+	uris->atom_Double        = map->map(map->handle, LV2_ATOM__Double);
 	uris->atom_Float         = map->map(map->handle, LV2_ATOM__Float);
+	uris->atom_Int           = map->map(map->handle, LV2_ATOM__Int);
+	uris->atom_Long          = map->map(map->handle, LV2_ATOM__Long);
 	uris->atom_Path          = map->map(map->handle, LV2_ATOM__Path);
 	uris->atom_Resource      = map->map(map->handle, LV2_ATOM__Resource);
 	uris->atom_Sequence      = map->map(map->handle, LV2_ATOM__Sequence);
+	uris->atom_String        = map->map(map->handle, LV2_ATOM__String);
 	uris->atom_URID          = map->map(map->handle, LV2_ATOM__URID);
+	uris->atom_Vector        = map->map(map->handle, LV2_ATOM__Vector);
 	uris->atom_eventTransfer = map->map(map->handle, LV2_ATOM__eventTransfer);
 	uris->applySample     = map->map(map->handle, SYNCROSE__applySample);
+	uris->analyseSample   = map->map(map->handle, SYNCROSE__analyseSample);
 	uris->freeSample      = map->map(map->handle, SYNCROSE__freeSample);
+	uris->freeSampleMap   = map->map(map->handle, SYNCROSE__freeSampleMap);
+	uris->loadSample      = map->map(map->handle, SYNCROSE__loadSample);
 	uris->sample          = map->map(map->handle, SYNCROSE__sample);
+	uris->sampleMap       = map->map(map->handle, SYNCROSE__sampleMap);
+	uris->zones           = map->map(map->handle, SYNCROSE__zones);
+	uris->Telemetry       = map->map(map->handle, SYNCROSE__Telemetry);
+	uris->playhead        = map->map(map->handle, SYNCROSE__playhead);
+	uris->grains          = map->map(map->handle, SYNCROSE__grains);
+	uris->Overview        = map->map(map->handle, SYNCROSE__Overview);
+	uris->peaks           = map->map(map->handle, SYNCROSE__peaks);
 	uris->midi_Event         = map->map(map->handle, LV2_MIDI__MidiEvent);
 	uris->param_gain         = map->map(map->handle, LV2_PARAMETERS__gain);
 	uris->patch_Get          = map->map(map->handle, LV2_PATCH__Get);
 	uris->patch_Set          = map->map(map->handle, LV2_PATCH__Set);
 	uris->patch_property     = map->map(map->handle, LV2_PATCH__property);
 	uris->patch_value        = map->map(map->handle, LV2_PATCH__value);
+	uris->time_Position      = map->map(map->handle, LV2_TIME__Position);
+	uris->time_bar           = map->map(map->handle, LV2_TIME__bar);
+	uris->time_barBeat       = map->map(map->handle, LV2_TIME__barBeat);
+	uris->time_beatUnit      = map->map(map->handle, LV2_TIME__beatUnit);
+	uris->time_beatsPerBar   = map->map(map->handle, LV2_TIME__beatsPerBar);
+	uris->time_beatsPerMinute = map->map(map->handle, LV2_TIME__beatsPerMinute);
+	uris->time_speed         = map->map(map->handle, LV2_TIME__speed);
 }
 
+/* Write a patch:Set of a path property, the sample or the sample map. */
 static inline LV2_Atom*
-write_set_file(LV2_Atom_Forge*    forge,
+write_set_path(LV2_Atom_Forge*     forge,
                const SyncroseURIs* uris,
-               const char*        filename,
-               const uint32_t     filename_len)
+               const LV2_URID      key,
+               const char*         filename,
+               const uint32_t      filename_len)
 {
 	LV2_Atom_Forge_Frame frame;
 	LV2_Atom* set = (LV2_Atom*)lv2_atom_forge_object(
 		forge, &frame, 0, uris->patch_Set);
 
 	lv2_atom_forge_key(forge, uris->patch_property);
-	lv2_atom_forge_urid(forge, uris->sample);
+	lv2_atom_forge_urid(forge, key);
 	lv2_atom_forge_key(forge, uris->patch_value);
 	lv2_atom_forge_path(forge, filename, filename_len);
 
@@ -69,9 +132,20 @@ write_set_file(LV2_Atom_Forge*    forge,
 	return set;
 }
 
+static inline LV2_Atom*
+write_set_file(LV2_Atom_Forge*    forge,
+               const SyncroseURIs* uris,
+               const char*        filename,
+               const uint32_t     filename_len)
+{
+	return write_set_path(forge, uris, uris->sample, filename, filename_len);
+}
+
+/* Read a patch:Set of the sample or the sample map, key is set to which. */
 static inline const LV2_Atom*
-read_set_file(const SyncroseURIs*     uris,
-              const LV2_Atom_Object* obj)
+read_set_path(const SyncroseURIs*     uris,
+              const LV2_Atom_Object* obj,
+              LV2_URID*              key)
 {
 	if (obj->body.otype != uris->patch_Set) {
 		fprintf(stderr, "Ignoring unknown message type %d\n", obj->body.otype);
@@ -87,10 +161,12 @@ read_set_file(const SyncroseURIs*     uris,
 	} else if (property->type != uris->atom_URID) {
 		fprintf(stderr, "Malformed set message has non-URID property.\n");
 		return NULL;
-	} else if (((const LV2_Atom_URID*)property)->body != uris->sample) {
+	} else if (((const LV2_Atom_URID*)property)->body != uris->sample &&
+	           ((const LV2_Atom_URID*)property)->body != uris->sampleMap) {
 		fprintf(stderr, "Set message for unknown property.\n");
 		return NULL;
 	}
+	*key = ((const LV2_Atom_URID*)property)->body;
 
 	/* Get value. */
 	const LV2_Atom* file_path = NULL;
@@ -106,4 +182,132 @@ read_set_file(const SyncroseURIs*     uris,
 	return file_path;
 }
 
+static inline const LV2_Atom*
+read_set_file(const SyncroseURIs*     uris,
+              const LV2_Atom_Object* obj)
+{
+	LV2_URID        key       = 0;
+	const LV2_Atom* file_path = read_set_path(uris, obj, &key);
+	return key == uris->sample ? file_path : NULL;
+}
+
+/* Size of a telemetry event with n_grains grains, including event header. */
+static inline uint32_t
+telemetry_size(uint32_t n_grains)
+{
+	return sizeof(LV2_Atom_Event)
+		+ sizeof(LV2_Atom_Object)
+		+ 2 * sizeof(uint32_t) + lv2_atom_pad_size(sizeof(LV2_Atom_Float))
+		+ 2 * sizeof(uint32_t) + sizeof(LV2_Atom_Vector)
+		+ 2 * sizeof(float) * n_grains;
+}
+
+/* Grains are (position, amplitude) pairs, positions normalised to 0..1. */
+static inline LV2_Atom*
+write_telemetry(LV2_Atom_Forge*     forge,
+                const SyncroseURIs* uris,
+                const float         playhead,
+                const float*        grains,
+                const uint32_t      n_grains)
+{
+	LV2_Atom_Forge_Frame frame;
+	LV2_Atom* tel = (LV2_Atom*)lv2_atom_forge_object(
+		forge, &frame, 0, uris->Telemetry);
+
+	lv2_atom_forge_key(forge, uris->playhead);
+	lv2_atom_forge_float(forge, playhead);
+	lv2_atom_forge_key(forge, uris->grains);
+	lv2_atom_forge_vector(forge, sizeof(float), uris->atom_Float,
+	                      2 * n_grains, grains);
+
+	lv2_atom_forge_pop(forge, &frame);
+
+	return tel;
+}
+
+static inline bool
+read_telemetry(const SyncroseURIs*    uris,
+               const LV2_Atom_Object* obj,
+               float*                 playhead,
+               const float**          grains,
+               uint32_t*              n_grains)
+{
+	const LV2_Atom* head = NULL;
+	const LV2_Atom* vec  = NULL;
+	lv2_atom_object_get(obj,
+	                    uris->playhead, &head,
+	                    uris->grains,   &vec,
+	                    0);
+	if (!head || head->type != uris->atom_Float) {
+		fprintf(stderr, "Telemetry message has no playhead.\n");
+		return false;
+	} else if (!vec || vec->type != uris->atom_Vector) {
+		fprintf(stderr, "Telemetry message has no grains.\n");
+		return false;
+	}
+
+	const LV2_Atom_Vector* v = (const LV2_Atom_Vector*)vec;
+	if (v->body.child_type != uris->atom_Float) {
+		fprintf(stderr, "Telemetry grains are not floats.\n");
+		return false;
+	}
+
+	*playhead = ((const LV2_Atom_Float*)head)->body;
+	*grains   = (const float*)(v + 1);
+	*n_grains = (v->atom.size - sizeof(LV2_Atom_Vector_Body))
+		/ (2 * sizeof(float));
+	return true;
+}
+
+/* Size of an overview event, including event header. */
+static inline uint32_t
+overview_size(void)
+{
+	return sizeof(LV2_Atom_Event)
+		+ sizeof(LV2_Atom_Object)
+		+ 2 * sizeof(uint32_t) + sizeof(LV2_Atom_Vector)
+		+ 2 * sizeof(float) * OVERVIEW_COLUMNS;
+}
+
+/* Overview is (min, max) pairs, one per column across the sample. */
+static inline LV2_Atom*
+write_overview(LV2_Atom_Forge*     forge,
+               const SyncroseURIs* uris,
+               const float*        peaks)
+{
+	LV2_Atom_Forge_Frame frame;
+	LV2_Atom* ov = (LV2_Atom*)lv2_atom_forge_object(
+		forge, &frame, 0, uris->Overview);
+
+	lv2_atom_forge_key(forge, uris->peaks);
+	lv2_atom_forge_vector(forge, sizeof(float), uris->atom_Float,
+	                      2 * OVERVIEW_COLUMNS, peaks);
+
+	lv2_atom_forge_pop(forge, &frame);
+
+	return ov;
+}
+
+static inline const float*
+read_overview(const SyncroseURIs*    uris,
+              const LV2_Atom_Object* obj)
+{
+	const LV2_Atom* vec = NULL;
+	lv2_atom_object_get(obj, uris->peaks, &vec, 0);
+	if (!vec || vec->type != uris->atom_Vector) {
+		fprintf(stderr, "Overview message has no peaks.\n");
+		return NULL;
+	}
+
+	const LV2_Atom_Vector* v = (const LV2_Atom_Vector*)vec;
+	if (v->body.child_type != uris->atom_Float ||
+	    v->atom.size - sizeof(LV2_Atom_Vector_Body)
+	    != 2 * sizeof(float) * OVERVIEW_COLUMNS) {
+		fprintf(stderr, "Overview peaks are malformed.\n");
+		return NULL;
+	}
+
+	return (const float*)(v + 1);
+}
+
 #endif  /* SYNCROSE_URIS_H */